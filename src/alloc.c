@@ -25,29 +25,257 @@ SOFTWARE.
 
 #include "alloc.h"
 
-#if 1
-
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static alloc_region_t current_region = REGION_GLOBAL;
+static alloc_tag_t    current_stage  = ALLOC_TAG_OTHER;
+
+alloc_region_t set_alloc_region(alloc_region_t region)
+{
+    alloc_region_t previous = current_region;
+    current_region = region;
+    return previous;
+}
+
+alloc_tag_t set_alloc_stage(alloc_tag_t stage)
+{
+    alloc_tag_t previous = current_stage;
+    current_stage = stage;
+    return previous;
+}
+
+// allocation statistics
+
+static const char* tag_names[ALLOC_TAG_COUNT] =
+{
+    "other", "lexer", "preprocessor", "parser", "semantic pass", "AST optimizer", "code generator", "asm optimizer"
+};
+
+typedef struct alloc_stats_t
+{
+    size_t bytes;
+    size_t allocs;
+    size_t reallocs;
+    size_t live;
+    size_t peak_live;
+} alloc_stats_t;
+
+#define MAX_ALLOC_SITES 1024 // power of two
+
+typedef struct alloc_site_t
+{
+    const char* file;
+    int line;
+    alloc_tag_t tag;
+    size_t bytes;
+    size_t allocs;
+    size_t reallocs;
+} alloc_site_t;
+
+static alloc_stats_t tag_stats[ALLOC_TAG_COUNT];
+static size_t live_per_region[REGION_COUNT][ALLOC_TAG_COUNT]; // so that release_region() can tell which subsystems it frees memory from
+static size_t total_live, peak_total_live;
+
+static int profile_sites;
+static alloc_site_t sites[MAX_ALLOC_SITES];
+static int site_count;
+
+void enable_alloc_profiling()
+{
+    profile_sites = 1;
+}
+
+static inline alloc_tag_t resolve_tag(alloc_tag_t tag)
+{
+    return tag == ALLOC_TAG_CURRENT ? current_stage : tag;
+}
+
+static inline alloc_region_t resolve_region(alloc_region_t region)
+{
+    return region == REGION_CURRENT ? current_region : region;
+}
+
+static alloc_site_t* find_site(const char* file, int line, alloc_tag_t tag)
+{
+    unsigned hash = ((unsigned)(uintptr_t)file >> 3) ^ ((unsigned)line * 2654435761u);
+    for (int probe = 0; probe < MAX_ALLOC_SITES; ++probe)
+    {
+        alloc_site_t* site = &sites[(hash + probe) & (MAX_ALLOC_SITES-1)];
+        if (site->file == NULL)
+        {
+            site->file = file;
+            site->line = line;
+            site->tag = tag;
+            ++site_count;
+            return site;
+        }
+        if (site->line == line && site->tag == tag && (site->file == file || strcmp(site->file, file) == 0))
+            return site;
+    }
+
+    return NULL; // table full, the site won't appear in the report
+}
+
+static void add_live(alloc_region_t region, alloc_tag_t tag, size_t bytes)
+{
+    live_per_region[region][tag] += bytes;
+
+    tag_stats[tag].live += bytes;
+    if (tag_stats[tag].live > tag_stats[tag].peak_live)
+        tag_stats[tag].peak_live = tag_stats[tag].live;
+
+    total_live += bytes;
+    if (total_live > peak_total_live)
+        peak_total_live = total_live;
+}
+
+static void remove_live(alloc_region_t region, alloc_tag_t tag, size_t bytes)
+{
+    // a block may be resized by another subsystem than the one which allocated it
+    if (bytes > live_per_region[region][tag])
+        bytes = live_per_region[region][tag];
+
+    live_per_region[region][tag] -= bytes;
+    tag_stats[tag].live -= bytes;
+    total_live -= bytes;
+}
+
+static void record_alloc(alloc_region_t region, alloc_tag_t tag, size_t bytes, const char* file, int line)
+{
+    tag_stats[tag].bytes += bytes;
+    ++tag_stats[tag].allocs;
+    add_live(region, tag, bytes);
+
+    if (profile_sites)
+    {
+        alloc_site_t* site = find_site(file, line, tag);
+        if (site)
+        {
+            site->bytes += bytes;
+            ++site->allocs;
+        }
+    }
+}
+
+// new_bytes : how much memory the reallocation added
+static void record_realloc(alloc_region_t region, alloc_tag_t tag, size_t new_bytes, const char* file, int line)
+{
+    tag_stats[tag].bytes += new_bytes;
+    ++tag_stats[tag].reallocs;
+    add_live(region, tag, new_bytes);
+
+    if (profile_sites)
+    {
+        alloc_site_t* site = find_site(file, line, tag);
+        if (site)
+        {
+            site->bytes += new_bytes;
+            ++site->reallocs;
+        }
+    }
+}
+
+static void record_release(alloc_region_t region)
+{
+    for (int tag = 0; tag < ALLOC_TAG_COUNT; ++tag)
+    {
+        tag_stats[tag].live -= live_per_region[region][tag];
+        total_live -= live_per_region[region][tag];
+        live_per_region[region][tag] = 0;
+    }
+}
+
+static const char* file_basename(const char* path)
+{
+    const char* base = path;
+    for (const char* ptr = path; *ptr; ++ptr)
+        if (*ptr == '/' || *ptr == '\\')
+            base = ptr + 1;
+    return base;
+}
+
+static int compare_sites(const void* lhs, const void* rhs)
+{
+    const alloc_site_t* a = *(const alloc_site_t**)lhs;
+    const alloc_site_t* b = *(const alloc_site_t**)rhs;
+    return (a->bytes < b->bytes) - (a->bytes > b->bytes);
+}
+
+#define REPORTED_SITES 20
+
+void print_memory_report(FILE* stream)
+{
+    alloc_stats_t total = {0};
+
+    fprintf(stream, "memory report :\n");
+    fprintf(stream, "  %-16s %12s %12s %14s %14s\n", "subsystem", "allocs", "reallocs", "bytes", "peak live");
+    for (int tag = 0; tag < ALLOC_TAG_COUNT; ++tag)
+    {
+        const alloc_stats_t* stats = &tag_stats[tag];
+        fprintf(stream, "  %-16s %12zu %12zu %14zu %14zu\n", tag_names[tag], stats->allocs, stats->reallocs, stats->bytes, stats->peak_live);
+
+        total.allocs   += stats->allocs;
+        total.reallocs += stats->reallocs;
+        total.bytes    += stats->bytes;
+    }
+    fprintf(stream, "  %-16s %12zu %12zu %14zu %14zu\n", "total", total.allocs, total.reallocs, total.bytes, peak_total_live);
+
+    if (!profile_sites || site_count == 0)
+        return;
+
+    alloc_site_t** sorted = (alloc_site_t**)malloc(site_count * sizeof(alloc_site_t*));
+    int count = 0;
+    for (int i = 0; i < MAX_ALLOC_SITES; ++i)
+        if (sites[i].file)
+            sorted[count++] = &sites[i];
+    qsort(sorted, count, sizeof(alloc_site_t*), compare_sites);
+
+    fprintf(stream, "top allocation sites :\n");
+    fprintf(stream, "  %14s %12s %12s  %s\n", "bytes", "allocs", "reallocs", "site");
+    for (int i = 0; i < count && i < REPORTED_SITES; ++i)
+    {
+        fprintf(stream, "  %14zu %12zu %12zu  %s:%d (%s)\n", sorted[i]->bytes, sorted[i]->allocs, sorted[i]->reallocs,
+                file_basename(sorted[i]->file), sorted[i]->line, tag_names[sorted[i]->tag]);
+    }
+
+    free(sorted);
+}
+
+#ifdef DANPA_ALLOC_TRACKING
+
+// debugging allocator : one malloc per object, every pointer is recorded so that it can be checked and freed later
 
 #define INITIAL_MAX_CHUNKS 0x1000
 
-static void** allocated_chunks;
-static int chunk_count;
-static int chunk_capacity;
+typedef struct region_t
+{
+    void** allocated_chunks;
+    size_t* chunk_sizes;
+    int chunk_count;
+    int chunk_capacity;
+} region_t;
+
+static region_t regions[REGION_COUNT];
 static int allocated_memory;
 
-static void expand_array(size_t new_size)
+static void expand_array(region_t* region, size_t new_size)
 {
-    allocated_chunks = (void**)realloc(allocated_chunks, new_size * sizeof(void*));
-    chunk_capacity = new_size;
+    region->allocated_chunks = (void**)realloc(region->allocated_chunks, new_size * sizeof(void*));
+    region->chunk_sizes = (size_t*)realloc(region->chunk_sizes, new_size * sizeof(size_t));
+    region->chunk_capacity = new_size;
 }
 
-void *danpa_alloc(size_t bytes)
+void* danpa_tagged_alloc(alloc_region_t region_id, size_t bytes, alloc_tag_t tag, const char* file, int line)
 {
-    if (allocated_chunks == NULL)
+    region_id = resolve_region(region_id);
+    region_t* region = &regions[region_id];
+    if (region->allocated_chunks == NULL)
     {
-        expand_array(INITIAL_MAX_CHUNKS);
+        expand_array(region, INITIAL_MAX_CHUNKS);
     }
 
     void* ptr = malloc(bytes);
@@ -57,27 +285,44 @@ void *danpa_alloc(size_t bytes)
         abort();
     }
 
-    allocated_chunks[chunk_count] = ptr;
-    ++chunk_count;
-    if (chunk_count >= chunk_capacity)
-        expand_array(chunk_capacity + chunk_capacity/2); // *1.5
+    region->allocated_chunks[region->chunk_count] = ptr;
+    region->chunk_sizes[region->chunk_count] = bytes;
+    ++region->chunk_count;
+    if (region->chunk_count >= region->chunk_capacity)
+        expand_array(region, region->chunk_capacity + region->chunk_capacity/2); // *1.5
 
     allocated_memory += bytes;
+    record_alloc(region_id, resolve_tag(tag), bytes, file, line);
 
     return ptr;
 }
 
-void *danpa_realloc(void* ptr, size_t new_size)
+void* danpa_tagged_realloc(void* ptr, size_t new_size, alloc_tag_t tag, const char* file, int line)
 {
     if (ptr == 0)
-        return danpa_alloc(new_size);
+        return danpa_tagged_alloc(REGION_CURRENT, new_size, tag, file, line);
 
-    for (int i = 0; i < chunk_count; ++i)
+    tag = resolve_tag(tag);
+    for (int r = 0; r < REGION_COUNT; ++r)
     {
-        if (ptr == allocated_chunks[i])
+        region_t* region = &regions[r];
+        for (int i = 0; i < region->chunk_count; ++i)
         {
-            allocated_chunks[i] = realloc(ptr, new_size);
-            return allocated_chunks[i];
+            if (ptr == region->allocated_chunks[i])
+            {
+                const size_t old_size = region->chunk_sizes[i];
+                if (new_size > old_size)
+                    record_realloc(r, tag, new_size - old_size, file, line);
+                else
+                {
+                    record_realloc(r, tag, 0, file, line);
+                    remove_live(r, tag, old_size - new_size);
+                }
+
+                region->allocated_chunks[i] = realloc(ptr, new_size);
+                region->chunk_sizes[i] = new_size;
+                return region->allocated_chunks[i];
+            }
         }
     }
 
@@ -85,76 +330,259 @@ void *danpa_realloc(void* ptr, size_t new_size)
     abort();
 }
 
-void cleanup_memory()
+void release_region(alloc_region_t region_id)
 {
-    printf("allocated %d + %d bytes, %d/%d slots\n", allocated_memory, chunk_capacity*sizeof(void*), chunk_count, chunk_capacity);
+    region_t* region = &regions[region_id];
+    for (int i = 0; i < region->chunk_count; ++i)
+    {
+        free(region->allocated_chunks[i]);
+    }
+
+    free(region->allocated_chunks);
+    free(region->chunk_sizes);
+    region->allocated_chunks = NULL;
+    region->chunk_sizes = NULL;
+    region->chunk_count = region->chunk_capacity = 0;
 
-    for (int i = 0; i < chunk_count; ++i)
+    record_release(region_id);
+}
+
+void cleanup_memory()
+{
+    int chunk_count = 0, chunk_capacity = 0;
+    for (int i = 0; i < REGION_COUNT; ++i)
     {
-        free(allocated_chunks[i]);
+        chunk_count    += regions[i].chunk_count;
+        chunk_capacity += regions[i].chunk_capacity;
     }
+    printf("allocated %d + %d bytes, %d/%d slots\n", allocated_memory, chunk_capacity*sizeof(void*), chunk_count, chunk_capacity);
 
-    free(allocated_chunks);
+    for (int i = 0; i < REGION_COUNT; ++i)
+        release_region(i);
 }
 
 #else
 
-#include <stdint.h>
-
-#define CHUNK_SIZE 0x10000
+// arena allocator : small objects are bump-allocated from CHUNK_SIZE chunks, objects larger than LARGE_ALLOC_SIZE get
+// a dedicated chunk of their own which can be grown with realloc().
+// every object is preceded by a small header so that danpa_realloc() can find its chunk in O(1), and grow it in place
+// if it is the last object allocated in its chunk.
+// blocks are aligned like malloc() ones : the header is padded to ALLOC_ALIGN and sits right before its block.
 
+#define CHUNK_SIZE       0x10000
+#define LARGE_ALLOC_SIZE (CHUNK_SIZE/8)
+#define ALLOC_ALIGN      _Alignof(max_align_t)
+#define HEADER_SIZE      align_size(sizeof(alloc_header_t))
 
 typedef struct chunk_t
 {
-    unsigned used_size;
-    uint8_t data[];
+    size_t capacity;
+    size_t used_size;
+    unsigned index; // position in its region's chunk_list
+    uint8_t region;
+    uint8_t is_large;
+    _Alignas(max_align_t) uint8_t data[];
 } chunk_t;
 
-static chunk_t** chunk_list;
-static unsigned chunk_count;
-static unsigned chunk_capacity;
+typedef struct alloc_header_t
+{
+    uint32_t size;
+    uint32_t chunk_offset; // distance between the header and the start of its chunk
+} alloc_header_t;
+
+typedef struct region_t
+{
+    chunk_t** chunk_list;
+    unsigned chunk_count;
+    unsigned chunk_capacity;
+    chunk_t* current_chunk;
+} region_t;
+
+static region_t regions[REGION_COUNT];
+
+static size_t allocated_memory;
+static size_t reserved_memory;
+static size_t released_memory;
+
+static inline size_t align_size(size_t bytes)
+{
+    return (bytes + ALLOC_ALIGN-1) & ~(size_t)(ALLOC_ALIGN-1);
+}
 
+static inline alloc_header_t* get_header(void* ptr)
+{
+    return (alloc_header_t*)ptr - 1;
+}
 
-static void expand_array(size_t new_size)
+static inline chunk_t* get_chunk(alloc_header_t* header)
 {
-    chunk_list = (chunk_t**)realloc(chunk_list, new_size * sizeof(chunk_t*));
-    chunk_capacity = new_size;
+    return (chunk_t*)((uint8_t*)header - header->chunk_offset);
 }
 
+static void out_of_memory()
+{
+    fprintf(stderr, "memory allocation error\n");
+    abort();
+}
 
-void *danpa_alloc(size_t bytes)
+static chunk_t* new_chunk(alloc_region_t region_id, size_t capacity, int is_large)
 {
-    for (int i = 0; i < chunk_count; ++i)
+    region_t* region = &regions[region_id];
+    if (region->chunk_count >= region->chunk_capacity)
     {
-        if ((CHUNK_SIZE - chunk_list[i]->used_size) >= bytes)
+        region->chunk_capacity = region->chunk_capacity ? region->chunk_capacity + region->chunk_capacity/2 : 64; // *1.5
+        region->chunk_list = (chunk_t**)realloc(region->chunk_list, region->chunk_capacity * sizeof(chunk_t*));
+        if (!region->chunk_list)
+            out_of_memory();
+    }
+
+    chunk_t* chunk = (chunk_t*)malloc(sizeof(chunk_t) + capacity);
+    if (!chunk)
+        out_of_memory();
+    chunk->capacity = capacity;
+    chunk->used_size = 0;
+    chunk->index = region->chunk_count;
+    chunk->region = region_id;
+    chunk->is_large = is_large;
+
+    region->chunk_list[region->chunk_count++] = chunk;
+    reserved_memory += capacity;
+
+    return chunk;
+}
+
+static void* bump_alloc(chunk_t* chunk, size_t bytes)
+{
+    uint8_t* block = &chunk->data[chunk->used_size + HEADER_SIZE];
+    alloc_header_t* header = get_header(block);
+    header->size = bytes;
+    header->chunk_offset = (uint8_t*)header - (uint8_t*)chunk;
+
+    chunk->used_size += HEADER_SIZE + align_size(bytes);
+
+    return block;
+}
+
+static void* arena_alloc(alloc_region_t region_id, size_t bytes)
+{
+    allocated_memory += bytes;
+
+    if (bytes > LARGE_ALLOC_SIZE)
+        return bump_alloc(new_chunk(region_id, HEADER_SIZE + align_size(bytes), 1), bytes);
+
+    region_t* region = &regions[region_id];
+    const size_t needed = HEADER_SIZE + align_size(bytes);
+    if (region->current_chunk == NULL || region->current_chunk->capacity - region->current_chunk->used_size < needed)
+        region->current_chunk = new_chunk(region_id, CHUNK_SIZE, 0);
+
+    return bump_alloc(region->current_chunk, bytes);
+}
+
+void* danpa_tagged_alloc(alloc_region_t region_id, size_t bytes, alloc_tag_t tag, const char* file, int line)
+{
+    region_id = resolve_region(region_id);
+    record_alloc(region_id, resolve_tag(tag), bytes, file, line);
+
+    return arena_alloc(region_id, bytes);
+}
+
+void* danpa_tagged_realloc(void* ptr, size_t new_size, alloc_tag_t tag, const char* file, int line)
+{
+    if (ptr == 0)
+        return danpa_tagged_alloc(REGION_CURRENT, new_size, tag, file, line);
+
+    alloc_header_t* header = get_header(ptr);
+    chunk_t* chunk = get_chunk(header);
+    const size_t old_size = header->size;
+
+    tag = resolve_tag(tag);
+    record_realloc(chunk->region, tag, new_size > old_size ? new_size - old_size : 0, file, line);
+    // a shrunk block is resized in place, the bytes past its new end aren't live anymore
+    if (new_size < old_size)
+        remove_live(chunk->region, tag, old_size - new_size);
+
+    // dedicated chunk : let the system allocator do the work
+    if (chunk->is_large)
+    {
+        if (new_size <= old_size)
         {
-            void* ret = &chunk_list[i]->data[chunk_list[i]->used_size];
-            chunk_list[i]->used_size += bytes;
+            header->size = new_size;
+            return ptr;
+        }
+
+        allocated_memory += new_size - old_size;
+
+        const size_t new_capacity = HEADER_SIZE + align_size(new_size);
+        reserved_memory += new_capacity - chunk->capacity;
+
+        chunk = (chunk_t*)realloc(chunk, sizeof(chunk_t) + new_capacity);
+        if (!chunk)
+            out_of_memory();
+        chunk->capacity = chunk->used_size = new_capacity;
+        regions[chunk->region].chunk_list[chunk->index] = chunk;
+
+        header = get_header(&chunk->data[HEADER_SIZE]);
+        header->size = new_size;
+        return header + 1;
+    }
 
-            return ret;
+    // last allocation of its chunk : grow or shrink in place
+    uint8_t* block_end = (uint8_t*)ptr + align_size(old_size);
+    if (block_end == &chunk->data[chunk->used_size] && new_size <= LARGE_ALLOC_SIZE)
+    {
+        const size_t new_used = (uint8_t*)ptr - chunk->data + align_size(new_size);
+        if (new_used <= chunk->capacity)
+        {
+            if (new_size > old_size)
+                allocated_memory += new_size - old_size;
+            chunk->used_size = new_used;
+            header->size = new_size;
+            return ptr;
         }
     }
 
-    ++chunk_count;
-    if (chunk_count > chunk_capacity)
+    if (new_size <= old_size)
     {
-        if (chunk_capacity == 0)
-            chunk_capacity = 2;
-        expand_array(chunk_capacity + chunk_capacity/2);
+        header->size = new_size;
+        return ptr;
     }
-    // allocate another chunk
-    chunk_list[chunk_count-1] = (chunk_t*)malloc(CHUNK_SIZE + sizeof(chunk_t));
-    chunk_list[chunk_count-1]->used_size = bytes;
-    return &chunk_list[chunk_count-1]->data;
+
+    // move the data to a new block, the old one is only released along with its region
+    void* new_ptr = arena_alloc(chunk->region, new_size);
+    add_live(chunk->region, tag, old_size); // the old block is still held
+    memcpy(new_ptr, ptr, old_size);
+
+    return new_ptr;
 }
 
-void cleanup_memory()
+void release_region(alloc_region_t region_id)
 {
-    for (int i = 0; i < chunk_count; ++i)
+    region_t* region = &regions[region_id];
+    for (unsigned i = 0; i < region->chunk_count; ++i)
     {
-        free(chunk_list[i]);
+        released_memory += region->chunk_list[i]->capacity;
+        free(region->chunk_list[i]);
     }
-    free(chunk_list);
+    free(region->chunk_list);
+
+    region->chunk_list = NULL;
+    region->chunk_count = region->chunk_capacity = 0;
+    region->current_chunk = NULL;
+
+    record_release(region_id);
+}
+
+void cleanup_memory()
+{
+    unsigned chunk_count = 0;
+    for (int i = 0; i < REGION_COUNT; ++i)
+        chunk_count += regions[i].chunk_count;
+
+    printf("allocated %zu bytes, %zu bytes reserved in %u live chunks, %zu bytes released early\n",
+           allocated_memory, reserved_memory, chunk_count, released_memory);
+
+    for (int i = 0; i < REGION_COUNT; ++i)
+        release_region(i);
 }
 
 #endif
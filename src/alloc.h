@@ -26,10 +26,60 @@ SOFTWARE.
 #define ALLOC_H
 
 #include <stddef.h>
+#include <stdio.h>
 
-void* danpa_alloc(size_t bytes);
-void *danpa_realloc(void* ptr, size_t new_size);
+// memory is owned by the allocator : it is released either a region at a time by release_region(), or all at once by cleanup_memory()
+// define DANPA_ALLOC_TRACKING to use a malloc-per-object allocator instead of the arena, for debugging purposes
 
+// each compilation stage allocates from its own region, so that its memory can be released once the pipeline has moved past it
+typedef enum alloc_region_t
+{
+    REGION_CURRENT = -1, // the region selected by set_alloc_region()
+
+    REGION_GLOBAL = 0, // lives until cleanup_memory() : source buffers, token strings and source locations used by diagnostics
+    REGION_LEXER,      // token lists, macro definitions and preprocessing temporaries, released after parsing
+    REGION_AST,        // AST nodes and type tables, released after code generation
+    REGION_IR,         // instruction list
+
+    REGION_COUNT
+} alloc_region_t;
+
+// allocation statistics are gathered per subsystem : every source file that allocates defines ALLOC_TAG to its subsystem's tag
+// shared code (types, hash tables...) uses ALLOC_TAG_CURRENT, which charges the compilation stage selected by set_alloc_stage()
+typedef enum alloc_tag_t
+{
+    ALLOC_TAG_CURRENT = -1,
+
+    ALLOC_TAG_OTHER = 0,
+    ALLOC_TAG_LEXER,
+    ALLOC_TAG_PREPROCESSOR,
+    ALLOC_TAG_PARSER,
+    ALLOC_TAG_SEMANTIC,
+    ALLOC_TAG_AST_OPTIMIZER,
+    ALLOC_TAG_CODEGEN,
+    ALLOC_TAG_ASM_OPTIMIZER,
+
+    ALLOC_TAG_COUNT
+} alloc_tag_t;
+
+#define danpa_alloc(bytes)            danpa_tagged_alloc(REGION_CURRENT, bytes, ALLOC_TAG, __FILE__, __LINE__)
+#define danpa_alloc_in(region, bytes) danpa_tagged_alloc(region, bytes, ALLOC_TAG, __FILE__, __LINE__)
+// the block stays in the region it was allocated from
+#define danpa_realloc(ptr, new_size)  danpa_tagged_realloc(ptr, new_size, ALLOC_TAG, __FILE__, __LINE__)
+
+void* danpa_tagged_alloc(alloc_region_t region, size_t bytes, alloc_tag_t tag, const char* file, int line);
+void* danpa_tagged_realloc(void* ptr, size_t new_size, alloc_tag_t tag, const char* file, int line);
+
+// returns the previously selected region
+alloc_region_t set_alloc_region(alloc_region_t region);
+// returns the previously selected stage
+alloc_tag_t set_alloc_stage(alloc_tag_t stage);
+
+// also record statistics per allocation site, for print_memory_report()
+void enable_alloc_profiling();
+void print_memory_report(FILE* stream);
+
+void release_region(alloc_region_t region);
 void cleanup_memory();
 
 #endif // ALLOC_H
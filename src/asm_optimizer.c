@@ -2,6 +2,9 @@
 
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+
+#define ALLOC_TAG ALLOC_TAG_ASM_OPTIMIZER
 
 typedef enum opt_pass_behavior
 {
@@ -21,7 +24,7 @@ static inline void remove_ins(instruction_t* ins)
     // shift the labels to the next instruction
     for (int i = 0; i < ins->labels.size; ++i)
     {
-        DYNARRAY_ADD(ins->next->labels, ins->labels.ptr[i]);
+        SMALL_DYNARRAY_ADD(ins->next->labels, SMALL_DYNARRAY_DATA(ins->labels)[i]);
     }
 }
 
@@ -53,7 +56,7 @@ static void find_label_targets(instruction_t* ins_list)
     while (ins)
     {
         for (int i = 0; i < ins->labels.size; ++i)
-            hash_table_insert(&label_targets, ins->labels.ptr[i], (hash_value_t){.ptr = ins});
+            hash_table_insert(&label_targets, SMALL_DYNARRAY_DATA(ins->labels)[i], (hash_value_t){.ptr = ins});
 
         ins = ins->next;
     }
@@ -96,12 +99,12 @@ static opt_pass_behavior peephole_cmov(instruction_t* ins)
         return SKIP;
     if (strcmp(ins_2->operand, ins_5->operand) != 0)
         return SKIP;
-    if (ins_4->labels.size != 1 || strcmp(ins_4->labels.ptr[0], ins->operand) != 0)
+    if (ins_4->labels.size != 1 || strcmp(SMALL_DYNARRAY_DATA(ins_4->labels)[0], ins->operand) != 0)
         return SKIP;
     int target_found = 0;
     for (int i = 0; i < ins_6->labels.size; ++i)
     {
-        if (strcmp(ins_6->labels.ptr[i], ins_3->operand) == 0)
+        if (strcmp(SMALL_DYNARRAY_DATA(ins_6->labels)[i], ins_3->operand) == 0)
             target_found = 1;
     }
     if (target_found == 0)
@@ -362,7 +365,7 @@ static opt_pass_behavior peephole_jcc_jmp(instruction_t* ins)
         int found_label = 0;
         for (int i = 0; i < ins->next->next->labels.size; ++i)
         {
-            if (strcmp(ins->operand, ins->next->next->labels.ptr[i]) == 0)
+            if (strcmp(ins->operand, SMALL_DYNARRAY_DATA(ins->next->next->labels)[i]) == 0)
                 found_label = 1;
         }
         if (!found_label)
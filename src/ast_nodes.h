@@ -166,7 +166,7 @@ typedef struct match_pattern_t
 typedef struct match_case_t
 {
     int is_wildcard;
-    DYNARRAY(match_pattern_t) patterns;
+    SMALL_DYNARRAY(match_pattern_t, 2) patterns;
     struct expression_t* expr;
     type_t value_type;
     source_location_t loc;
@@ -509,6 +509,7 @@ typedef struct function_t
 
     DYNARRAY(statement_t) statement_list;
     DYNARRAY(local_variable_t) locals;
+    int local_declaration_count; // used to size 'locals'
 } function_t;
 
 typedef struct program_t
@@ -29,6 +29,8 @@ Copyright (c) 24 Yann BOUCHER (yann)
 #include <assert.h>
 #include <math.h>
 
+#define ALLOC_TAG ALLOC_TAG_AST_OPTIMIZER
+
         static inline int int_log2(uint32_t x)
 {
 #if defined(__clang__) || defined(__GNUC__)
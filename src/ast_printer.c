@@ -64,7 +64,7 @@ static void print_float_constant(token_t* value)
 
 static void print_string_literal(token_t* value)
 {
-    printf_tab("String \"%s\"\n", value->data.str);
+    printf_tab("String \"%.*s\"\n", value->data.slice.length, value->data.slice.ptr);
 }
 
 AST_PROGRAM()
@@ -89,7 +89,7 @@ AST_FUNCTION()
     printf_tab("Function %s %s(", type_to_str(&arg_function->signature.ret_type), arg_function->name->data.str);
     for (int i = 0; i < arg_function->signature.parameter_types.size; ++i)
     {
-        printf("%s", type_to_str(&arg_function->signature.parameter_types.ptr[i]));
+        printf("%s", type_to_str(&SMALL_DYNARRAY_DATA(arg_function->signature.parameter_types)[i]));
         if (i != (arg_function->signature.parameter_types.size - 1))
             printf(", ");
     }
@@ -464,7 +464,7 @@ AST_MATCH_CASE()
     {
         printf_tab("Case patterns :\n");
         for (int i = 0; i < arg_match_case->patterns.size; ++i)
-            print_match_pattern(&arg_match_case->patterns.ptr[i]);
+            print_match_pattern(&SMALL_DYNARRAY_DATA(arg_match_case->patterns)[i]);
     }
     else
     {
@@ -4,14 +4,16 @@
 #include "code_generator.h"
 #include "error.h"
 
+#define ALLOC_TAG ALLOC_TAG_CODEGEN
+
 #define MK_SIGNATURE(ret, ...) \
     ({ \
 function_signature_t sig; \
 sig.ret_type = ret; \
-DYNARRAY_INIT(sig.parameter_types, 8); \
+SMALL_DYNARRAY_INIT(sig.parameter_types); \
 type_t arg_array[] = { __VA_ARGS__ }; \
 for (unsigned i = 0; i < sizeof(arg_array)/sizeof(type_t); ++i) \
-    DYNARRAY_ADD(sig.parameter_types, arg_array[i]); \
+    SMALL_DYNARRAY_ADD(sig.parameter_types, arg_array[i]); \
 sig; \
 })
 
@@ -179,7 +181,7 @@ void callback_find(func_arg_list_t args)
             .signature = MK_SIGNATURE(__VA_ARGS__), \
     .generate = callback_##name \
             }; \
-    hash_table_insert(&builtin_table, #name  , (hash_value_t){.ptr = &builtin_##name});
+    hash_table_insert_interned(&builtin_table, intern_string(#name, sizeof(#name)-1), (hash_value_t){.ptr = &builtin_##name});
 
 void init_builtins()
 {
@@ -230,7 +232,7 @@ void init_builtins()
 builtin_t* find_builtin(const char* name)
 {
     hash_value_t* val;
-    if ((val = hash_table_get(&builtin_table, name)))
+    if ((val = hash_table_get_interned(&builtin_table, name)))
     {
         return (builtin_t*)val->ptr;
     }
@@ -37,6 +37,8 @@ SOFTWARE.
 #define AST_PASS_NAME generate
 #include "ast_functions.h"
 
+#define ALLOC_TAG ALLOC_TAG_CODEGEN
+
 #define LABEL_MAX_LEN 16
 
     static label_list_t loop_entry_labels; // no need for dynarray_init if it is declared as global, auto zero'ed
@@ -45,6 +47,7 @@ static label_list_t loop_exit_labels;
     FILE* out_stream;
 
     program_t* current_program = NULL;
+instruction_t* instruction_list = NULL;
 instruction_t* current_instruction = NULL;
 label_list_t next_instruction_labels;
 char* next_instruction_comments;
@@ -93,9 +96,9 @@ void generate(const char* op, const char* operand, ...)
     va_end(args);
 
     instruction_t* next = danpa_alloc(sizeof(instruction_t));
-    DYNARRAY_INIT(next->labels, next_instruction_labels.size);
-    DYNARRAY_RESIZE(next->labels, next_instruction_labels.size);
-    memcpy(next->labels.ptr, next_instruction_labels.ptr, next_instruction_labels.size*sizeof(const char*));
+    SMALL_DYNARRAY_INIT(next->labels);
+    SMALL_DYNARRAY_RESIZE(next->labels, next_instruction_labels.size);
+    memcpy(SMALL_DYNARRAY_DATA(next->labels), next_instruction_labels.ptr, next_instruction_labels.size*sizeof(const char*));
 
     next->opcode = op;
     next->operand = buffer;
@@ -217,20 +220,21 @@ static void generate_string_literal(token_t* val)
 {
     hash_value_t* node;
 
-    if (strlen(val->data.str) < 64) // show short strings as a comment in the asm output
+    if (val->data.slice.length < 64) // show short strings as a comment in the asm output
     {
-        add_comment("// \"%s\"", val->data.str);
+        add_comment("// \"%.*s\"", val->data.slice.length, val->data.slice.ptr);
     }
 
     // if the string already exists in the string table, reuse it
-    if ((node = hash_table_get(&current_program->strings, val->data.str)))
+    const char* str = string_literal_str(val);
+    if ((node = hash_table_get_interned(&current_program->strings, str)))
     {
         generate("pushs", "%d", node->idx);
     }
     else
     {
         int idx = current_program->strings.count;
-        hash_table_insert(&current_program->strings, val->data.str, (hash_value_t){.idx = idx});
+        hash_table_insert_interned(&current_program->strings, str, (hash_value_t){.idx = idx});
         generate("pushs", "%d", idx);
     }
 }
@@ -616,7 +620,7 @@ AST_MATCH_CASE()
     for (int i = 0; i < arg_match_case->patterns.size; ++i)
     {
         generate("pushl","%d", arg_match_case->test_expr_loc_id);
-        generate_match_pattern(&arg_match_case->patterns.ptr[i]);
+        generate_match_pattern(&SMALL_DYNARRAY_DATA(arg_match_case->patterns)[i]);
         if (i != 0)
         {
             generate("logicand","");
@@ -33,7 +33,7 @@ typedef DYNARRAY(const char*) label_list_t;
 
 typedef struct instruction_t
 {
-    label_list_t labels;
+    SMALL_DYNARRAY(const char*, 2) labels;
     const char* opcode;
     const char* operand;
     const char* comment;
@@ -41,7 +41,7 @@ typedef struct instruction_t
     struct instruction_t* next;
 } instruction_t;
 
-instruction_t* instruction_list;
+extern instruction_t* instruction_list;
 
 extern const char binop_opcodes[POD_TYPES_END][OP_BIN_END][8];
 extern const char unary_opcodes[POD_TYPES_END][OP_UNARY_END - OP_BIN_END][8];
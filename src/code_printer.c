@@ -7,7 +7,7 @@ void print_code_output(instruction_t* list, FILE* stream)
     {
         // output the code
         for (int i = 0; i < list->labels.size; ++i)
-            fprintf(stream, "%s:\n", list->labels.ptr[i]);
+            fprintf(stream, "%s:\n", SMALL_DYNARRAY_DATA(list->labels)[i]);
         fprintf(stream, "%s %s %s\n", list->opcode, list->operand, (list->comment ?: ""));
 
         list = list->next;
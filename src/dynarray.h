@@ -27,7 +27,7 @@ SOFTWARE.
 
 #include "alloc.h"
 
-#define DYNARRAY_PRE_ALLOCATE 0
+#include <string.h>
 
 #define DYNARRAY(type) \
     struct { \
@@ -35,30 +35,50 @@ SOFTWARE.
         type* ptr; \
     }
 
+// default_capacity is a hint : the array is allocated with room for that many elements up-front
 #define DYNARRAY_INIT(array, default_capacity) \
     do { \
     (array).size = 0; \
-    (array).capacity = (default_capacity) * DYNARRAY_PRE_ALLOCATE; \
-    if ((array).capacity) \
+    (array).capacity = (default_capacity); \
+    if ((array).capacity > 0) \
         (array).ptr = danpa_alloc((array).capacity * sizeof(*(array).ptr)); \
     else \
         (array).ptr = NULL; \
     } while (0)
 
+// for arrays which are filled right away with memcpy : allocates exactly 'count' elements
+#define DYNARRAY_INIT_EXACT(array, count) \
+    do { \
+    (array).size = (array).capacity = (count); \
+    if ((array).capacity > 0) \
+        (array).ptr = danpa_alloc((array).capacity * sizeof(*(array).ptr)); \
+    else \
+        (array).ptr = NULL; \
+    } while (0)
+
+// makes sure the array can hold at least min_capacity elements without being reallocated
+#define DYNARRAY_RESERVE(array, min_capacity) \
+    do { \
+    if ((min_capacity) > (array).capacity) { \
+        (array).capacity = (min_capacity); \
+        (array).ptr = danpa_realloc((array).ptr, sizeof(*(array).ptr)*(array).capacity);} \
+    } while (0)
+
 #define DYNARRAY_RESIZE(array, target_size) \
     do { \
     (array).size = target_size; \
-    while ((array).size >= (array).capacity) {\
+    if ((array).size > (array).capacity) {\
         if ((array).capacity == 0) \
             (array).capacity = 1; \
-        (array).capacity *= 2;} \
-        (array).ptr = danpa_realloc((array).ptr, sizeof(*(array).ptr)*(array).capacity);\
+        while ((array).size > (array).capacity) \
+            (array).capacity *= 2; \
+        (array).ptr = danpa_realloc((array).ptr, sizeof(*(array).ptr)*(array).capacity);}\
     } while (0)
 
 #define DYNARRAY_ADD(array, ...) \
     do { \
     ++(array).size; \
-    if ((array).size >= (array).capacity) {\
+    if ((array).size > (array).capacity) {\
         if ((array).capacity == 0) \
             (array).capacity = 1; \
         (array).capacity *= 2; \
@@ -75,4 +95,66 @@ SOFTWARE.
 #define DYNARRAY_BACK(array) \
     ((array).ptr[(array).size-1])
 
+// dynamic array storing up to N elements inline, only spilling to the heap past that
+// the inline storage shares its space with the heap pointer : the elements must be accessed through SMALL_DYNARRAY_DATA,
+// which also makes these arrays safe to copy by value as long as they haven't spilled
+#define SMALL_DYNARRAY(type, N) \
+    struct { \
+        int size, heap_capacity; /* heap_capacity is 0 while the elements are stored inline */ \
+        union { \
+            type* heap_ptr; \
+            type inline_data[N]; \
+        }; \
+    }
+
+#define SMALL_DYNARRAY_INLINE_CAPACITY(array) \
+    ((int)(sizeof((array).inline_data) / sizeof(*(array).inline_data)))
+
+#define SMALL_DYNARRAY_DATA(array) \
+    ((array).heap_capacity ? (array).heap_ptr : (array).inline_data)
+
+#define SMALL_DYNARRAY_INIT(array) \
+    do { \
+    (array).size = 0; \
+    (array).heap_capacity = 0; \
+    } while (0)
+
+// makes room for 'count' elements, the first (array).size ones being preserved
+#define SMALL_DYNARRAY_GROW(array, count) \
+    do { \
+    if ((array).heap_capacity == 0) { \
+        if ((count) > SMALL_DYNARRAY_INLINE_CAPACITY(array)) { \
+            int small_new_capacity = SMALL_DYNARRAY_INLINE_CAPACITY(array)*2; \
+            while (small_new_capacity < (count)) \
+                small_new_capacity *= 2; \
+            typeof((array).heap_ptr) small_heap = danpa_alloc(sizeof(*(array).heap_ptr)*small_new_capacity); \
+            memcpy(small_heap, (array).inline_data, sizeof(*(array).heap_ptr)*(array).size); \
+            (array).heap_ptr = small_heap; \
+            (array).heap_capacity = small_new_capacity;}} \
+    else if ((count) > (array).heap_capacity) { \
+        while ((array).heap_capacity < (count)) \
+            (array).heap_capacity *= 2; \
+        (array).heap_ptr = danpa_realloc((array).heap_ptr, sizeof(*(array).heap_ptr)*(array).heap_capacity);} \
+    } while (0)
+
+#define SMALL_DYNARRAY_RESIZE(array, target_size) \
+    do { \
+    int small_new_size = (target_size); \
+    SMALL_DYNARRAY_GROW(array, small_new_size); \
+    (array).size = small_new_size; \
+    } while (0)
+
+#define SMALL_DYNARRAY_ADD(array, ...) \
+    do { \
+    typeof(*(array).heap_ptr) tmp = __VA_ARGS__; \
+    SMALL_DYNARRAY_GROW(array, (array).size + 1); \
+    SMALL_DYNARRAY_DATA(array)[(array).size++] = tmp; \
+    } while (0)
+
+#define SMALL_DYNARRAY_POP(array) \
+    DYNARRAY_POP(array)
+
+#define SMALL_DYNARRAY_BACK(array) \
+    (SMALL_DYNARRAY_DATA(array)[(array).size-1])
+
 #endif // DYNARRAY_H
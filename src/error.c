@@ -57,25 +57,28 @@ static void common_handler(const char* type, source_location_t where, int length
     if (where.macro_invok_token)
     {
         if (where.macro_invok_type == INCLUDED_TOKEN)
-            info(where.macro_invok_token->location, where.macro_invok_token->length, "in file included from :\n");
+            info(*token_loc(where.macro_invok_token), where.macro_invok_token->length, "in file included from :\n");
         else if (where.macro_invok_type == MACRO_TOKEN)
-            info(where.macro_invok_token->location, where.macro_invok_token->length, "in expansion of macro '%s' :\n", where.macro_invok_token->data.str);
+            info(*token_loc(where.macro_invok_token), where.macro_invok_token->length, "in expansion of macro '%s' :\n", where.macro_invok_token->data.str);
     }
 
     char code[length + 1];
     memcpy(code, where.ptr, length);
     code[length] = '\0';
 
-    fprintf(stderr, ESC_FONT_BOLD "%s:%d:%d: %s", where.filename, where.line, (int)(where.ptr - where.line_ptr + 1), type);
+    const char* line_start;
+    const int line = location_line(&where, &line_start);
+
+    fprintf(stderr, ESC_FONT_BOLD "%s:%d:%d: %s", get_source_file(where.file_id)->filename, line, (int)(where.ptr - line_start + 1), type);
     vfprintf(stderr, fmt, *args);
     printf(ESC_FONT_NORMAL);
     // show the line as context
     // don't show the identation
-    while (isspace(*where.line_ptr))
-        ++where.line_ptr;
+    while (isspace(*line_start))
+        ++line_start;
     printf("        "); // instead put a small indentation of 8 spaces
 
-    const char* line_ptr = where.line_ptr;
+    const char* line_ptr = line_start;
     while (!is_newline(line_ptr) && *line_ptr != '\0')
     {
         putchar(*line_ptr);
@@ -84,7 +87,7 @@ static void common_handler(const char* type, source_location_t where, int length
     putchar('\n');
 
     // underline the errornous part
-    line_ptr = where.line_ptr;
+    line_ptr = line_start;
     printf("        "); // same indentation
     while (line_ptr < where.ptr)
     {
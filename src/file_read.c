@@ -2,31 +2,395 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "alloc.h"
 
-uint8_t* read_file(const char* filename)
+#if defined(__unix__) || defined(__APPLE__)
+#define DANPA_HAS_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#endif
+
+#define ALLOC_TAG ALLOC_TAG_CURRENT
+
+#define STREAM_READ_CHUNK (64*1024)
+
+// diagnostics point into the source buffers : every buffer is followed by a '\n' and the null terminator,
+// and is kept around until close_source_files()
+
+// pipes and other non-seekable inputs are read chunk by chunk
+static uint8_t* read_stream(FILE* input, size_t* size)
 {
-    FILE *input = fopen(filename, "rb");
-    if (!input)
+    size_t capacity = STREAM_READ_CHUNK;
+    size_t fsize = 0;
+    uint8_t* source_buffer = (uint8_t*)danpa_alloc_in(REGION_GLOBAL, capacity + 2);
+
+    size_t read;
+    while ((read = fread(source_buffer + fsize, 1, capacity - fsize, input)) > 0)
+    {
+        fsize += read;
+        if (fsize == capacity)
+        {
+            capacity *= 2;
+            source_buffer = (uint8_t*)danpa_realloc(source_buffer, capacity + 2);
+        }
+    }
+
+    if (fsize == 0)
         return NULL;
 
-    fseek(input, 0, SEEK_END);
-    long fsize = ftell(input);
-    rewind(input);  /* same as rewind(f); */
+    source_buffer[fsize] = '\n'; // automatically add an ending newline
+    source_buffer[fsize+1] = '\0';
+
+    if (size)
+        *size = fsize;
+
+    return source_buffer;
+}
 
-    if (fsize <= 0)
+#ifdef DANPA_HAS_MMAP
+
+typedef struct mapped_file_t
+{
+    void* addr;
+    size_t length;
+    struct mapped_file_t* next;
+} mapped_file_t;
+
+static mapped_file_t* mapped_files;
+
+// the pages are shared with the page cache, and are only read in when the lexer reaches them.
+// doesn't allocate : safe to call from the prefetch threads
+static uint8_t* map_file_pages(int fd, size_t fsize, size_t* length)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    // room for the sentinel bytes, which may need an extra page past the end of the file
+    *length = (fsize + 2 + page_size - 1) & ~(page_size - 1);
+
+    // reserve the whole range with zero-filled pages, then map the file over it
+    uint8_t* base = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mmap(base, fsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
     {
+        munmap(base, *length);
         return NULL;
     }
+    madvise(base, fsize, MADV_SEQUENTIAL);
 
-    uint8_t* source_buffer = (uint8_t*)danpa_alloc(fsize + 2);
-    fread(source_buffer, 1, fsize, input);
-    source_buffer[fsize] = '\n'; // automatically add an ending newline
-    source_buffer[fsize+1] = '\0';
-    fclose(input);
+    // the rest of the last page is zero-filled, so the null terminator is already there.
+    // only that page becomes a private copy
+    base[fsize] = '\n';
+
+    return base;
+}
+
+static void register_mapping(uint8_t* base, size_t length)
+{
+    mapped_file_t* mapping = (mapped_file_t*)danpa_alloc_in(REGION_GLOBAL, sizeof(mapped_file_t));
+    mapping->addr = base;
+    mapping->length = length;
+    mapping->next = mapped_files;
+    mapped_files = mapping;
+}
+
+// Included files are loaded ahead of time by a few worker threads : they map the file and fault its pages in,
+// so the lexer doesn't wait on the disk when it reaches the '#include'.
+// The workers don't touch the allocator, read_file() registers their mappings once it claims them.
+
+#define MAX_PREFETCH_THREADS 4
+
+typedef struct prefetch_job_t
+{
+    const char* filename;
+    enum
+    {
+        JOB_PENDING,
+        JOB_RUNNING,
+        JOB_DONE,
+        JOB_CLAIMED
+    } state;
+    uint8_t* base; // NULL if the file has to go through the regular path (missing, empty or not a regular file)
+    size_t fsize;
+    size_t length;
+    struct prefetch_job_t* next;
+} prefetch_job_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t job_added;
+    pthread_cond_t job_done;
+    pthread_t threads[MAX_PREFETCH_THREADS];
+    int thread_count;
+    int shutdown;
+    prefetch_job_t* first_job;
+    prefetch_job_t* last_job;
+} prefetch = { .lock = PTHREAD_MUTEX_INITIALIZER, .job_added = PTHREAD_COND_INITIALIZER, .job_done = PTHREAD_COND_INITIALIZER };
+
+static void load_job(prefetch_job_t* job)
+{
+    job->base = NULL;
+
+    int fd = open(job->filename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        job->fsize = (size_t)st.st_size;
+        job->base = map_file_pages(fd, job->fsize, &job->length);
+    }
+    close(fd);
+
+    if (job->base)
+    {
+        // fault the pages in
+        const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        madvise(job->base, job->fsize, MADV_WILLNEED);
+        volatile uint8_t sink = 0;
+        for (size_t offset = 0; offset < job->fsize; offset += page_size)
+            sink += ((volatile uint8_t*)job->base)[offset];
+        (void)sink;
+    }
+}
+
+static prefetch_job_t* first_pending_job()
+{
+    for (prefetch_job_t* job = prefetch.first_job; job; job = job->next)
+        if (job->state == JOB_PENDING)
+            return job;
+    return NULL;
+}
+
+static void* prefetch_thread(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&prefetch.lock);
+    while (!prefetch.shutdown)
+    {
+        prefetch_job_t* job = first_pending_job();
+        if (!job)
+        {
+            pthread_cond_wait(&prefetch.job_added, &prefetch.lock);
+            continue;
+        }
+
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&prefetch.lock);
+        load_job(job);
+        pthread_mutex_lock(&prefetch.lock);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&prefetch.job_done);
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+
+    return NULL;
+}
+
+void prefetch_file(const char* filename)
+{
+    pthread_mutex_lock(&prefetch.lock);
+
+    for (prefetch_job_t* job = prefetch.first_job; job; job = job->next)
+        if (strcmp(job->filename, filename) == 0)
+        {
+            pthread_mutex_unlock(&prefetch.lock);
+            return;
+        }
+
+    if (prefetch.thread_count == 0)
+    {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (threads < 1)
+            threads = 1;
+        if (threads > MAX_PREFETCH_THREADS)
+            threads = MAX_PREFETCH_THREADS;
+        for (int i = 0; i < threads; ++i)
+            if (pthread_create(&prefetch.threads[prefetch.thread_count], NULL, prefetch_thread, NULL) == 0)
+                ++prefetch.thread_count;
+    }
+
+    prefetch_job_t* job = (prefetch_job_t*)danpa_alloc_in(REGION_GLOBAL, sizeof(prefetch_job_t));
+    job->filename = filename;
+    job->state = JOB_PENDING;
+    job->base = NULL;
+    job->next = NULL;
+    if (prefetch.last_job)
+        prefetch.last_job->next = job;
+    else
+        prefetch.first_job = job;
+    prefetch.last_job = job;
+
+    pthread_cond_signal(&prefetch.job_added);
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+// takes the result of the file's prefetch job, if there is one. a job that no thread picked up yet is run here
+static prefetch_job_t* claim_prefetched_file(const char* filename)
+{
+    pthread_mutex_lock(&prefetch.lock);
+
+    prefetch_job_t* job = prefetch.first_job;
+    while (job && (job->state == JOB_CLAIMED || strcmp(job->filename, filename) != 0))
+        job = job->next;
+
+    if (job && job->state == JOB_PENDING)
+    {
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&prefetch.lock);
+        load_job(job);
+        pthread_mutex_lock(&prefetch.lock);
+    }
+    else if (job)
+    {
+        while (job->state != JOB_DONE)
+            pthread_cond_wait(&prefetch.job_done, &prefetch.lock);
+    }
+
+    if (job)
+        job->state = JOB_CLAIMED;
+    pthread_mutex_unlock(&prefetch.lock);
+
+    return job;
+}
+
+uint8_t* read_file(const char* filename, size_t* size)
+{
+    if (strcmp(filename, "-") == 0)
+        return read_stream(stdin, size);
+
+    prefetch_job_t* job = claim_prefetched_file(filename);
+    if (job && job->base)
+    {
+        register_mapping(job->base, job->length);
+        if (size)
+            *size = job->fsize;
+        return job->base;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+
+        FILE* input = fopen(filename, "rb");
+        if (!input)
+            return NULL;
+        uint8_t* source_buffer = read_stream(input, size);
+        fclose(input);
+        return source_buffer;
+    }
+
+    const size_t fsize = (size_t)st.st_size;
+    size_t length;
+    uint8_t* source_buffer = fsize > 0 ? map_file_pages(fd, fsize, &length) : NULL;
+    close(fd);
+
+    if (source_buffer)
+        register_mapping(source_buffer, length);
+
+    if (source_buffer && size)
+        *size = fsize;
+
+    return source_buffer;
+}
 
+int file_identity(const char* filename, char* path, size_t path_size, int64_t* mtime, int64_t* size)
+{
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (!realpath(filename, resolved) || stat(resolved, &st) != 0 || strlen(resolved) >= path_size)
+        return 0;
+
+    strcpy(path, resolved);
+    // a file rewritten within the same second must still be told apart
+#ifdef __APPLE__
+    *mtime = (int64_t)st.st_mtimespec.tv_sec*1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    *mtime = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+#endif
+    *size = (int64_t)st.st_size;
+    return 1;
+}
+
+void close_source_files()
+{
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.shutdown = 1;
+    pthread_cond_broadcast(&prefetch.job_added);
+    pthread_mutex_unlock(&prefetch.lock);
+    for (int i = 0; i < prefetch.thread_count; ++i)
+        pthread_join(prefetch.threads[i], NULL);
+    prefetch.thread_count = 0;
+
+    // files that were prefetched but never included
+    for (prefetch_job_t* job = prefetch.first_job; job; job = job->next)
+        if (job->state != JOB_CLAIMED && job->base)
+            munmap(job->base, job->length);
+    prefetch.first_job = prefetch.last_job = NULL;
+
+    while (mapped_files)
+    {
+        munmap(mapped_files->addr, mapped_files->length);
+        mapped_files = mapped_files->next;
+    }
+}
+
+#else
+
+void prefetch_file(const char* filename)
+{
+    (void)filename;
+}
+
+uint8_t* read_file(const char* filename, size_t* size)
+{
+    if (strcmp(filename, "-") == 0)
+        return read_stream(stdin, size);
 
+    FILE* input = fopen(filename, "rb");
+    if (!input)
+        return NULL;
+
+    uint8_t* source_buffer = read_stream(input, size);
+    fclose(input);
 
     return source_buffer;
 }
+
+// without a way to resolve paths, files are identified by their name
+int file_identity(const char* filename, char* path, size_t path_size, int64_t* mtime, int64_t* size)
+{
+    FILE* input = fopen(filename, "rb");
+    if (!input || strlen(filename) >= path_size)
+    {
+        if (input)
+            fclose(input);
+        return 0;
+    }
+    fseek(input, 0, SEEK_END);
+    *size = ftell(input);
+    fclose(input);
+
+    strcpy(path, filename);
+    *mtime = 0;
+    return 1;
+}
+
+void close_source_files()
+{
+}
+
+#endif
@@ -2,7 +2,17 @@
 #define FILE_READ_H
 
 #include <stdint.h>
+#include <stddef.h>
 
-uint8_t* read_file(const char* filename);
+// 'size' receives the file size in bytes, it may be NULL. "-" reads the standard input.
+// regular files are memory-mapped, the buffer is null-terminated either way
+uint8_t* read_file(const char* filename, size_t* size);
+// starts loading the file in the background, read_file() picks the result up
+void prefetch_file(const char* filename);
+// identifies a file by its canonical path, written to 'path', its modification time in nanoseconds and its size.
+// returns 0 if the file can't be found
+int file_identity(const char* filename, char* path, size_t path_size, int64_t* mtime, int64_t* size);
+// unmaps the source buffers : to be called before cleanup_memory()
+void close_source_files();
 
 #endif // FILE_READ_H
@@ -2,8 +2,9 @@
 #define HASH_H_INCLUDED
 
 #include <stdint.h>
+#include <stddef.h>
 
-uint64_t str_hash(const char *str)
+static inline uint64_t str_hash(const char *str)
 {
     uint64_t hash = 5381;
     uint64_t c;
@@ -14,4 +15,15 @@ uint64_t str_hash(const char *str)
     return hash;
 }
 
+// same as str_hash(), for strings which aren't null-terminated
+static inline uint64_t str_hash_n(const char *str, size_t length)
+{
+    uint64_t hash = 5381;
+
+    for (size_t i = 0; i < length; ++i)
+        hash = ((hash << 5) + hash) + (uint8_t)str[i]; /* hash * 33 + c */
+
+    return hash;
+}
+
 #endif // HASH_H_INCLUDED
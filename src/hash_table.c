@@ -5,6 +5,8 @@
 
 #include <string.h>
 
+#define ALLOC_TAG ALLOC_TAG_CURRENT
+
 hash_table_t mk_hash_table(size_t bucket_count)
 {
     hash_table_t table;
@@ -16,12 +18,51 @@ hash_table_t mk_hash_table(size_t bucket_count)
     return table;
 }
 
-void hash_table_insert(hash_table_t* table, const char* key, hash_value_t val)
+// a node of bucket i moves either to bucket i or to bucket i + old_count, the order of each chain is kept
+static void grow_table(hash_table_t* table)
 {
-    int hash = str_hash(key) % table->bucket_count;
+    const size_t old_count = table->bucket_count;
+    table->bucket_count = old_count*2;
+    // stays in the region the table was created in
+    table->buckets = danpa_realloc(table->buckets, sizeof(hash_node_t*)*table->bucket_count);
+
+    for (size_t i = 0; i < old_count; ++i)
+    {
+        hash_node_t*  low  = NULL;
+        hash_node_t*  high = NULL;
+        hash_node_t** low_tail  = &low;
+        hash_node_t** high_tail = &high;
+        for (hash_node_t* chain = table->buckets[i]; chain; chain = chain->next_node)
+        {
+            if (chain->key_hash % table->bucket_count == i)
+            {
+                *low_tail = chain;
+                low_tail = &chain->next_node;
+            }
+            else
+            {
+                *high_tail = chain;
+                high_tail = &chain->next_node;
+            }
+        }
+        *low_tail  = NULL;
+        *high_tail = NULL;
+
+        table->buckets[i]             = low;
+        table->buckets[i + old_count] = high;
+    }
+}
+
+static void insert_node(hash_table_t* table, uint64_t key_hash, const char* key, hash_value_t val)
+{
+    if ((size_t)table->count >= table->bucket_count*3/4)
+        grow_table(table);
+
+    int hash = key_hash % table->bucket_count;
 
     hash_node_t* new_node = danpa_alloc(sizeof(hash_node_t));
     new_node->key = key;
+    new_node->key_hash = key_hash;
     new_node->value = val;
     new_node->next_node = NULL;
 
@@ -39,6 +80,16 @@ void hash_table_insert(hash_table_t* table, const char* key, hash_value_t val)
     ++table->count;
 }
 
+void hash_table_insert(hash_table_t* table, const char* key, hash_value_t val)
+{
+    insert_node(table, str_hash(key), key, val);
+}
+
+void hash_table_insert_interned(hash_table_t* table, const char* key, hash_value_t val)
+{
+    insert_node(table, get_interned(key)->hash, key, val);
+}
+
 hash_value_t* hash_table_get(hash_table_t* table, const char* key)
 {
     int hash = str_hash(key) % table->bucket_count;
@@ -56,6 +107,22 @@ hash_value_t* hash_table_get(hash_table_t* table, const char* key)
     return NULL;
 }
 
+hash_value_t* hash_table_get_interned(hash_table_t* table, const char* key)
+{
+    int hash = get_interned(key)->hash % table->bucket_count;
+
+    hash_node_t* chain = table->buckets[hash];
+    while (chain)
+    {
+        if (chain->key == key)
+            return &chain->value;
+
+        chain = chain->next_node;
+    }
+
+    return NULL;
+}
+
 void hash_table_remove(hash_table_t* table, const char* key)
 {
     int hash = str_hash(key) % table->bucket_count;
@@ -73,14 +140,13 @@ void hash_table_remove(hash_table_t* table, const char* key)
                 table->buckets[hash] = chain->next_node;
             //free(chain);
 
+            --table->count;
             break;
         }
 
         previous = chain;
         chain = chain->next_node;
     }
-
-    --table->count;
 }
 
 void  hash_table_clear(hash_table_t* table)
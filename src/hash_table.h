@@ -12,12 +12,13 @@ typedef union hash_value_t
     void(*fn_ptr)(const char*, void*);
     int idx;
     const char* str;
-    macro_def_t macro_def;
+    macro_def_t* macro_def;
 } hash_value_t;
 
 typedef struct hash_node_t
 {
     const char* key;
+    uint64_t key_hash; // kept to redistribute the nodes when the table grows
     union  hash_value_t value;
     struct hash_node_t* next_node;
 } hash_node_t;
@@ -29,10 +30,14 @@ typedef struct hash_table_t
     hash_node_t** buckets;
 } hash_table_t;
 
+// 'bucket_count' is only the initial size : the table doubles it once it holds more than 3/4 as many keys
 hash_table_t mk_hash_table(size_t bucket_count);
 
 void          hash_table_insert(hash_table_t* table, const char* key, hash_value_t val);
 hash_value_t* hash_table_get(hash_table_t* table, const char* key);
+// for tables whose keys are all interned strings (see intern_string()) : reuses their stored hash and compares them by address
+void          hash_table_insert_interned(hash_table_t* table, const char* key, hash_value_t val);
+hash_value_t* hash_table_get_interned(hash_table_t* table, const char* key);
 void          hash_table_remove(hash_table_t* table, const char* key);
 void          hash_table_clear(hash_table_t* table);
 void          hash_table_iterate(hash_table_t* table, void (*callback)(hash_node_t*));
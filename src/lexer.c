@@ -27,15 +27,19 @@ Copyright (c) 14 Yann BOUCHER (yann)
 #include "error.h"
 #include "dynarray.h"
 #include "alloc.h"
+#include "hash.h"
 
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <assert.h>
 
 #include "preprocessor.h"
 
+#define ALLOC_TAG ALLOC_TAG_LEXER
+
         const char* tokens_str[TOKEN_ENUM_END] =
         {
             "<eof>",
@@ -87,161 +91,271 @@ Copyright (c) 14 Yann BOUCHER (yann)
 
 static inline int is_first_ident_char(char c)
 {
-    return isalpha(c) || c == '_';
+    return char_class[(unsigned char)c] & CC_IDENT_FIRST;
 }
 
 static inline int is_ident_char(char c)
 {
-    return isalnum(c) || c == '_';
+    return char_class[(unsigned char)c] & CC_IDENT;
 }
 
-const char* match_operator(const char* ptr, token_t* tok)
+// punctuators that aren't listed in operators[]
+static const struct
 {
-    if (strncmp(ptr, "+=", 2) == 0)
-    {
-        tok->type = TOK_ADD_ASSIGNMENT_OP;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "-=", 2) == 0)
-    {
-        tok->type = TOK_SUB_ASSIGNMENT_OP;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "*=", 2) == 0)
-    {
-        tok->type = TOK_MUL_ASSIGNMENT_OP;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "/=", 2) == 0)
-    {
-        tok->type = TOK_DIV_ASSIGNMENT_OP;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "%=", 2) == 0)
+    const char* str;
+    token_type_t type;
+} punctuators[] =
+{
+    {"(", TOK_OPEN_PARENTHESIS},
+    {")", TOK_CLOSE_PARENTHESIS},
+    {"{", TOK_OPEN_BRACE},
+    {"}", TOK_CLOSE_BRACE},
+    {"[", TOK_OPEN_BRACKET},
+    {"]", TOK_CLOSE_BRACKET},
+    {",", TOK_COMMA},
+    {":", TOK_COLON},
+    {";", TOK_SEMICOLON},
+    {".", TOK_DOT},
+    {"..", TOK_SLICE_DOTS},
+    {"...", TOK_ELLIPSIS},
+    {"?", TOK_QUESTION},
+    {"->", TOK_ARROW},
+    {"=>", TOK_MATCH_OP},
+    {"#", TOK_HASH},
+    {"=", TOK_ASSIGNMENT_OP},
+    {"+=", TOK_ADD_ASSIGNMENT_OP},
+    {"-=", TOK_SUB_ASSIGNMENT_OP},
+    {"*=", TOK_MUL_ASSIGNMENT_OP},
+    {"/=", TOK_DIV_ASSIGNMENT_OP},
+    {"%=", TOK_MOD_ASSIGNMENT_OP},
+    {"~=", TOK_CAT_ASSIGNMENT_OP},
+};
+
+#define PUNCT_MAX_NODES 64
+
+// longest-match trie; a node's children are chained through next_sibling
+typedef struct punct_node_t
+{
+    char ch;
+    char terminal;
+    short first_child;
+    short next_sibling;
+    short type;
+    short op;
+} punct_node_t;
+
+static punct_node_t punct_nodes[PUNCT_MAX_NODES];
+static int punct_node_count = 1; // node 0 means 'none'
+// first byte -> trie node
+static short punct_dispatch[256];
+
+static short punct_child(short node, char c)
+{
+    for (short child = punct_nodes[node].first_child; child; child = punct_nodes[child].next_sibling)
+        if (punct_nodes[child].ch == c)
+            return child;
+    return 0;
+}
+
+static short punct_new_node(char c)
+{
+    assert(punct_node_count < PUNCT_MAX_NODES);
+    punct_nodes[punct_node_count].ch = c;
+    return punct_node_count++;
+}
+
+static void punct_insert(const char* str, token_type_t type, operator_type_t op)
+{
+    short node = punct_dispatch[(unsigned char)*str];
+    if (!node)
+        node = punct_dispatch[(unsigned char)*str] = punct_new_node(*str);
+
+    while (*++str)
     {
-        tok->type = TOK_MOD_ASSIGNMENT_OP;
-        return ptr + 2;
+        short child = punct_child(node, *str);
+        if (!child)
+        {
+            child = punct_new_node(*str);
+            punct_nodes[child].next_sibling = punct_nodes[node].first_child;
+            punct_nodes[node].first_child = child;
+        }
+        node = child;
     }
-    if (strncmp(ptr, "~=", 2) == 0)
+
+    punct_nodes[node].terminal = 1;
+    punct_nodes[node].type = type;
+    punct_nodes[node].op = op;
+}
+
+static void build_punct_table()
+{
+    for (unsigned i = 0; i < sizeof(punctuators)/sizeof(punctuators[0]); ++i)
+        punct_insert(punctuators[i].str, punctuators[i].type, 0);
+    for (int i = 0; i < OP_ENUM_END; ++i)
     {
-        tok->type = TOK_CAT_ASSIGNMENT_OP;
-        return ptr + 2;
+        // 'in' is recognized by match_word
+        if (!is_first_ident_char(operators[i].str[0]))
+            punct_insert(operators[i].str, TOK_OPERATOR, (operator_type_t)i);
     }
+}
 
-    int longest_match = 0;
-    for (int i = 0; i < OP_ENUM_END; ++i)
+// matches delimiters, operators and assignment operators
+const char* match_punctuator(const char* ptr, token_t* tok)
+{
+    if (punct_node_count == 1)
+        build_punct_table();
+
+    short node = punct_dispatch[(unsigned char)*ptr];
+    const punct_node_t* longest = NULL;
+    const char* end = ptr;
+    while (node)
     {
-        const int len = strlen(operators[i].str);
-        if (strncmp(ptr, operators[i].str, len) == 0 && len > longest_match)
+        ++ptr;
+        if (punct_nodes[node].terminal)
         {
-            tok->type = TOK_OPERATOR;
-            tok->data.op = (operator_type_t)i;
-
-            longest_match = len;
+            longest = &punct_nodes[node];
+            end = ptr;
         }
+        node = punct_child(node, *ptr);
     }
-    if (longest_match != 0)
-        return ptr + longest_match;
 
-    if (strncmp(ptr, "=", 1) == 0)
-    {
-        tok->type = TOK_ASSIGNMENT_OP;
-        return ptr + 1;
-    }
+    if (!longest)
+        return NULL;
 
-    return NULL;
+    tok->type = longest->type;
+    if (longest->type == TOK_OPERATOR)
+        tok->data.op = longest->op;
+
+    return end;
 }
 
-const char* match_keyword(const char* ptr, token_t* tok)
+// the identifier has already been scanned : dispatch on its length, then on its first character
+static int classify_keyword(const char* str, int len, token_t* tok)
 {
-    if (strncmp(ptr, "if", 2) == 0 && !is_ident_char(ptr[2]))
-    {
-        tok->type = KEYWORD_IF;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "in", 2) == 0 && !is_ident_char(ptr[2]))
-    {
-        tok->type = TOK_OPERATOR;
-        tok->data.op = OP_IN;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "do", 2) == 0 && !is_ident_char(ptr[2]))
+#define KEYWORD(kw, type_) if (memcmp(str, kw, len) == 0) { tok->type = type_; return 1; }
+    switch (len)
     {
-        tok->type = KEYWORD_DO;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "for", 3) == 0 && !is_ident_char(ptr[3]))
-    {
-        tok->type = KEYWORD_FOR;
-        return ptr + 3;
-    }
-    if (strncmp(ptr, "asm", 3) == 0 && !is_ident_char(ptr[3]))
-    {
-        tok->type = KEYWORD_ASM;
-        return ptr + 3;
-    }
-    if (strncmp(ptr, "new", 3) == 0 && !is_ident_char(ptr[3]))
-    {
-        tok->type = KEYWORD_NEW;
-        return ptr + 3;
-    }
-    if (strncmp(ptr, "else", 4) == 0 && !is_ident_char(ptr[4]))
-    {
-        tok->type = KEYWORD_ELSE;
-        return ptr + 4;
-    }
-    if (strncmp(ptr, "null", 4) == 0 && !is_ident_char(ptr[4]))
-    {
-        tok->type = KEYWORD_NULL;
-        return ptr + 4;
-    }
-    if (strncmp(ptr, "while", 5) == 0 && !is_ident_char(ptr[5]))
-    {
-        tok->type = KEYWORD_WHILE;
-        return ptr + 5;
-    }
-    if (strncmp(ptr, "break", 5) == 0 && !is_ident_char(ptr[5]))
-    {
-        tok->type = KEYWORD_BREAK;
-        return ptr + 5;
-    }
-    if (strncmp(ptr, "match", 5) == 0 && !is_ident_char(ptr[5]))
-    {
-        tok->type = KEYWORD_MATCH;
-        return ptr + 5;
-    }
-    if (strncmp(ptr, "return", 6) == 0 && !is_ident_char(ptr[6]))
-    {
-        tok->type = KEYWORD_RETURN;
-        return ptr + 6;
-    }
-    if (strncmp(ptr, "struct", 6) == 0 && !is_ident_char(ptr[6]))
-    {
-        tok->type = KEYWORD_STRUCT;
-        return ptr + 6;
-    }
-    if (strncmp(ptr, "sizeof", 6) == 0 && !is_ident_char(ptr[6]))
-    {
-        tok->type = KEYWORD_SIZEOF;
-        return ptr + 6;
-    }
-    if (strncmp(ptr, "foreach", 7) == 0 && !is_ident_char(ptr[7]))
-    {
-        tok->type = KEYWORD_FOREACH;
-        return ptr + 7;
+        case 2:
+            switch (str[0])
+            {
+                case 'i':
+                    if (str[1] == 'f') { tok->type = KEYWORD_IF; return 1; }
+                    if (str[1] == 'n') { tok->type = TOK_OPERATOR; tok->data.op = OP_IN; return 1; }
+                    break;
+                case 'd':
+                    if (str[1] == 'o') { tok->type = KEYWORD_DO; return 1; }
+                    break;
+            }
+            break;
+        case 3:
+            switch (str[0])
+            {
+                case 'f': KEYWORD("for", KEYWORD_FOR); break;
+                case 'a': KEYWORD("asm", KEYWORD_ASM); break;
+                case 'n': KEYWORD("new", KEYWORD_NEW); break;
+            }
+            break;
+        case 4:
+            switch (str[0])
+            {
+                case 'e': KEYWORD("else", KEYWORD_ELSE); break;
+                case 'n': KEYWORD("null", KEYWORD_NULL); break;
+            }
+            break;
+        case 5:
+            switch (str[0])
+            {
+                case 'w': KEYWORD("while", KEYWORD_WHILE); break;
+                case 'b': KEYWORD("break", KEYWORD_BREAK); break;
+                case 'm': KEYWORD("match", KEYWORD_MATCH); break;
+            }
+            break;
+        case 6:
+            switch (str[0])
+            {
+                case 'r': KEYWORD("return", KEYWORD_RETURN); break;
+                case 's':
+                    KEYWORD("struct", KEYWORD_STRUCT);
+                    KEYWORD("sizeof", KEYWORD_SIZEOF);
+                    break;
+            }
+            break;
+        case 7:
+            switch (str[0])
+            {
+                case 'f': KEYWORD("foreach", KEYWORD_FOREACH); break;
+                case 't': KEYWORD("typedef", KEYWORD_TYPEDEF); break;
+            }
+            break;
+        case 8:
+            if (str[0] == 'c') KEYWORD("continue", KEYWORD_CONTINUE);
+            break;
     }
-    if (strncmp(ptr, "typedef", 7) == 0 && !is_ident_char(ptr[7]))
+#undef KEYWORD
+
+    return 0;
+}
+
+#define INTERN_TABLE_INITIAL_SIZE 1024 // power of two
+
+// open addressing, kept at most half full
+static const interned_str_t** intern_table;
+static unsigned intern_capacity;
+static unsigned intern_count;
+
+static inline unsigned intern_slot(uint64_t hash)
+{
+    return (unsigned)(hash ^ (hash >> 29)) & (intern_capacity-1);
+}
+
+static void grow_intern_table()
+{
+    const interned_str_t** old_table = intern_table;
+    const unsigned old_capacity = intern_capacity;
+
+    intern_capacity = old_capacity ? old_capacity*2 : INTERN_TABLE_INITIAL_SIZE;
+    intern_table = danpa_alloc_in(REGION_GLOBAL, intern_capacity*sizeof(interned_str_t*));
+    memset(intern_table, 0, intern_capacity*sizeof(interned_str_t*));
+
+    for (unsigned i = 0; i < old_capacity; ++i)
     {
-        tok->type = KEYWORD_TYPEDEF;
-        return ptr + 7;
+        if (old_table[i] == NULL)
+            continue;
+
+        unsigned slot = intern_slot(old_table[i]->hash);
+        while (intern_table[slot])
+            slot = (slot + 1) & (intern_capacity-1);
+        intern_table[slot] = old_table[i];
     }
-    if (strncmp(ptr, "continue", 8) == 0 && !is_ident_char(ptr[8]))
+}
+
+const char* intern_string(const char* str, int length)
+{
+    if (intern_count*2 >= intern_capacity)
+        grow_intern_table();
+
+    const uint64_t hash = str_hash_n(str, length);
+    unsigned slot = intern_slot(hash);
+    while (intern_table[slot])
     {
-        tok->type = KEYWORD_CONTINUE;
-        return ptr + 8;
+        const interned_str_t* entry = intern_table[slot];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->str, str, length) == 0)
+            return entry->str;
+
+        slot = (slot + 1) & (intern_capacity-1);
     }
 
-    return NULL;
+    // token strings outlive the token lists
+    interned_str_t* entry = danpa_alloc_in(REGION_GLOBAL, sizeof(interned_str_t) + length + 1);
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->str, str, length);
+    entry->str[length] = '\0';
+
+    intern_table[slot] = entry;
+    ++intern_count;
+
+    return entry->str;
 }
 
 const char* match_identifier(const char* ptr, token_t* tok)
@@ -261,12 +375,31 @@ const char* match_identifier(const char* ptr, token_t* tok)
         ++ptr;
     }
 
-    char* token_ident_str = (char*)danpa_alloc(ident_len+1);
-    memcpy(token_ident_str, first_char, ident_len);
-    token_ident_str[ident_len] = '\0';
-
     tok->type = TOK_IDENTIFIER;
-    tok->data.str = token_ident_str;
+    tok->data.str = intern_string(first_char, ident_len);
+
+    return ptr;
+}
+
+// scans an identifier once and classifies it as either a keyword or an identifier
+const char* match_word(const char* ptr, token_t* tok)
+{
+    const char* first_char = ptr;
+
+    if (!is_first_ident_char(*first_char))
+    {
+        return NULL;
+    }
+
+    while (is_ident_char(*ptr))
+        ++ptr;
+
+    const int ident_len = ptr - first_char;
+    if (!classify_keyword(first_char, ident_len, tok))
+    {
+        tok->type = TOK_IDENTIFIER;
+        tok->data.str = intern_string(first_char, ident_len);
+    }
 
     return ptr;
 }
@@ -344,9 +477,9 @@ const char* match_number_literal(const char* ptr, token_t* tok)
 // assumes we've already consumed the first '"'
 const char* end_of_string_lit(const char* str)
 {
-    while (*str)
+    while (*(str = scan_quote(str)))
     {
-        if (str[0] == '"' && str[-1] != '\\')
+        if (str[-1] != '\\')
             return str;
         ++str;
     }
@@ -364,131 +497,28 @@ const char* match_string_literal(const char* ptr, token_t* tok)
     const char* literal_end   = end_of_string_lit(ptr);
     if (literal_end == NULL)
         return NULL;
-    int literal_len = literal_end - literal_start;
-
-    char* tok_str = (char*)danpa_alloc(literal_len+1);
-
-    memcpy(tok_str, literal_start, literal_len);
-    tok_str[literal_len] = '\0';
 
     tok->type = TOK_STRING_LITERAL;
-    tok->data.str = tok_str;
+    tok->data.slice.ptr = literal_start;
+    tok->data.slice.length = literal_end - literal_start;
 
     ptr = literal_end + 1;
 
     return ptr;
 }
 
-const char* match_delimiter(const char* ptr, token_t* tok)
-{
-    if (strncmp(ptr, "(", 1) == 0)
-    {
-        tok->type = TOK_OPEN_PARENTHESIS;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, ")", 1) == 0)
-    {
-        tok->type = TOK_CLOSE_PARENTHESIS;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "{", 1) == 0)
-    {
-        tok->type = TOK_OPEN_BRACE;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "}", 1) == 0)
-    {
-        tok->type = TOK_CLOSE_BRACE;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "[", 1) == 0)
-    {
-        tok->type = TOK_OPEN_BRACKET;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "]", 1) == 0)
-    {
-        tok->type = TOK_CLOSE_BRACKET;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, ",", 1) == 0)
-    {
-        tok->type = TOK_COMMA;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, ":", 1) == 0)
-    {
-        tok->type = TOK_COLON;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, ";", 1) == 0)
-    {
-        tok->type = TOK_SEMICOLON;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "...", 3) == 0)
-    {
-        tok->type = TOK_ELLIPSIS;
-        return ptr + 3;
-    }
-    if (strncmp(ptr, "..", 2) == 0)
-    {
-        tok->type = TOK_SLICE_DOTS;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, ".", 1) == 0)
-    {
-        tok->type = TOK_DOT;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "?", 1) == 0)
-    {
-        tok->type = TOK_QUESTION;
-        return ptr + 1;
-    }
-    if (strncmp(ptr, "->", 2) == 0)
-    {
-        tok->type = TOK_ARROW;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "=>", 2) == 0)
-    {
-        tok->type = TOK_MATCH_OP;
-        return ptr + 2;
-    }
-    if (strncmp(ptr, "#", 1) == 0)
-    {
-        tok->type = TOK_HASH;
-        return ptr + 1;
-    }
-
-    return NULL;
-}
-
-const char* consume_comment(const char* ptr, source_location_t* loc)
+const char* consume_comment(const char* ptr)
 {
-    if (strncmp(ptr, "/*", 2) == 0)
+    if (ptr[1] == '*')
     {
-        while (*ptr && strncmp(ptr, "*/", 2) != 0)
-        {
-            if (is_newline(ptr))
-            {
-                skip_newline(&ptr);
-                update_loc_newline(loc, ptr);
-            }
-            else
-                ++ptr;
-        }
+        ptr = scan_block_comment(ptr);
 
         ptr += 2;
         return ptr;
     }
-    else if (strncmp(ptr, "//", 2) == 0)
+    else if (ptr[1] == '/')
     {
-        while (*ptr && !is_newline(ptr))
-            ++ptr;
-
-        return ptr;
+        return scan_line_end(ptr);
     }
 
     return NULL;
@@ -500,9 +530,12 @@ const char *do_tokenization(token_list_t* tokens, source_location_t* loc, int fl
 {
     int first_line = 1;
     int on_new_line;
+    int leading_space = 0;
     while (*loc->ptr)
     {
+        const char* token_start = loc->ptr;
         on_new_line = skip_whitespace(loc, !(flags & STOP_ON_NEWLINE));
+        leading_space |= loc->ptr != token_start;
         if (first_line && (flags & STARTS_ON_NEWLINE))
         {
             first_line = 0;
@@ -537,11 +570,11 @@ const char *do_tokenization(token_list_t* tokens, source_location_t* loc, int fl
             token_t* next_token = &next_token_list.ptr[0];
             int next_token_len = next_token->length;
             char* concat_token = danpa_alloc(prev_token->length+next_token->length+1);
-            memcpy(concat_token, prev_token->location.ptr, prev_token->length);
-            memcpy(concat_token+prev_token->length, next_token->location.ptr, next_token->length);
+            memcpy(concat_token, token_loc(prev_token)->ptr, prev_token->length);
+            memcpy(concat_token+prev_token->length, token_loc(next_token)->ptr, next_token->length);
             concat_token[prev_token->length+next_token->length] = '\0';
 
-            source_location_t mock_loc = prev_token->location;
+            source_location_t mock_loc = *token_loc(prev_token);
             mock_loc.ptr = concat_token;
             DYNARRAY_RESIZE(next_token_list, 0); // reuse next_token_list
             if (do_tokenization(&next_token_list, &mock_loc, LEX_SINGLE_TOKEN) == NULL)
@@ -550,8 +583,9 @@ const char *do_tokenization(token_list_t* tokens, source_location_t* loc, int fl
             }
             assert(next_token_list.size);
             token = next_token_list.ptr[0];
-            token.location = prev_token->location;
+            token.loc_id = prev_token->loc_id;
             token.length = prev_token->length+2+next_token_len;
+            token.leading_space = prev_token->leading_space;
 
             tokens->ptr[tokens->size-1] = token;
         }
@@ -560,21 +594,24 @@ const char *do_tokenization(token_list_t* tokens, source_location_t* loc, int fl
         {
             loc->ptr = next;
         }
-        // comments
-        else if (*loc->ptr == '/' && (next = consume_comment(loc->ptr, loc)))
+        // comments, a single token step goes on to the token that follows
+        else if (*loc->ptr == '/' && (next = consume_comment(loc->ptr)))
         {
             loc->ptr = next;
+            leading_space = 1;
+            continue;
         }
         // regular tokens
-        else if ((next = match_keyword(loc->ptr, &token))        ||
-                (next = match_delimiter(loc->ptr, &token))      ||
-                (next = match_identifier(loc->ptr, &token))     ||
+        else if ((next = match_word(loc->ptr, &token))           ||
+                (next = match_punctuator(loc->ptr, &token))     ||
                 (next = match_number_literal(loc->ptr, &token)) ||
-                (next = match_operator(loc->ptr, &token))       ||
                 (next = match_string_literal(loc->ptr, &token)))
         {
-            token.location = *loc;
+            token.loc_id = add_location(loc);
             token.length = next - loc->ptr;
+            token.leading_space = leading_space;
+            token.hide_set = 0;
+            leading_space = 0;
 
             DYNARRAY_ADD(*tokens, token);
             loc->ptr = next;
@@ -595,28 +632,39 @@ const char *do_tokenization(token_list_t* tokens, source_location_t* loc, int fl
     return loc->ptr;
 }
 
-void tokenize_program(token_list_t* tokens, const char *source, const char *filename)
+void benchmark_lexer(const char* source, size_t source_size, const char* filename)
 {
-    source_location_t loc;
-    loc.filename = filename;
-    loc.ptr = source;
-    loc.line = 1;
-    loc.line_ptr = source;
-    loc.macro_invok_token = NULL;
+    const alloc_region_t previous_region = set_alloc_region(REGION_LEXER);
 
-    do_tokenization(tokens, &loc, STARTS_ON_NEWLINE);
+    const int file_id = add_source_file(filename, source, source_size);
+    int passes = 0, token_count = 0;
+    const uint32_t first_location = location_count;
+    const clock_t start = clock();
+    clock_t elapsed;
+    do
+    {
+        init_pp(); // forget the macros defined by the previous pass
 
-    token_list_t expanded_list;
-    DYNARRAY_INIT(expanded_list, tokens->size);
-    do_macro_expansion(tokens, &expanded_list, 0);
+        token_list_t tokens;
+        DYNARRAY_INIT(tokens, source_size / BYTES_PER_TOKEN);
 
-    // do up to 16 layers of macro expansion
-    for (int i = 0; i < 16; ++i)
-    {
-        DYNARRAY_RESIZE(expanded_list, 0);
-        do_macro_expansion(tokens, &expanded_list, 0);
+        source_location_t loc;
+        loc.file_id = file_id;
+        loc.ptr = source;
+        loc.macro_invok_token = NULL;
+        do_tokenization(&tokens, &loc, STARTS_ON_NEWLINE);
 
-        DYNARRAY_RESIZE(*tokens, expanded_list.size);
-        memcpy(tokens->ptr, expanded_list.ptr, expanded_list.size*sizeof(token_t));
-    }
+        token_count = tokens.size;
+        ++passes;
+        release_region(REGION_LEXER);
+        truncate_locations(first_location);
+
+        elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC);
+
+    const double seconds = (double)elapsed / CLOCKS_PER_SEC;
+    printf("lexer : %d tokens, %d passes over %zu bytes in %.3fs : %.2f MB/s, %.0f tokens/s\n",
+           token_count, passes, source_size, seconds, source_size*passes/seconds/1e6, token_count*passes/seconds);
+
+    set_alloc_region(previous_region);
 }
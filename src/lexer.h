@@ -26,11 +26,13 @@ SOFTWARE.
 #define LEXER_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <string.h>
 
 #include "operators.h"
 #include "source_location.h"
+#include "scan.h"
 #include "dynarray.h"
 
 typedef enum token_type_t
@@ -97,24 +99,74 @@ typedef union token_data_t
     float fp;
     int op;
     const char* str;
+    // string literals reference their spelling (usually in the source buffer) and aren't null-terminated
+    struct
+    {
+        const char* ptr;
+        int length;
+    } slice;
 } token_data_t;
 
 typedef struct token_t
 {
     token_data_t data;
     token_type_t type;
-    source_location_t location;
-    int length;
+    int length : 31;
+    unsigned leading_space : 1; // whitespace or a comment came before the token, as '#' keeps it when stringifying
+    loc_id_t loc_id;
+    uint32_t hide_set; // the macros this token was produced by, which can't expand it again. 0 outside macro expansion
 } token_t;
 
+static inline const source_location_t* token_loc(const token_t* tok)
+{
+    return get_location(tok->loc_id);
+}
+
 typedef DYNARRAY(token_t) token_list_t;
 
+// identifiers are interned : each spelling has a single canonical copy, so identifiers can be compared by address.
+// the canonical string is preceded by its hash (the str_hash() of the string) and its length
+typedef struct interned_str_t
+{
+    uint64_t hash;
+    int length;
+    char str[];
+} interned_str_t;
+
+const char* intern_string(const char* str, int length);
+
+// returns the canonical null-terminated copy of a string literal's contents
+static inline const char* string_literal_str(const token_t* tok)
+{
+    return intern_string(tok->data.slice.ptr, tok->data.slice.length);
+}
+
+// 'str' must have been returned by intern_string()
+static inline const interned_str_t* get_interned(const char* str)
+{
+    return (const interned_str_t*)(str - offsetof(interned_str_t, str));
+}
+
+// rough source bytes / token ratio, used to size the token lists up-front
+#define BYTES_PER_TOKEN 4
+
+// what a macro body token stands for, resolved once when the macro is defined. parameters are designated by their index
+enum
+{
+    MACRO_BODY_LITERAL  = -1,
+    MACRO_BODY_VA_ARGS  = -2,
+    MACRO_BODY_VA_COUNT = -3
+};
+
 typedef struct macro_def_t
 {
     token_t* macro_ident;
+    int function_like; // defined with a parameter list, even an empty one
     int variadic;
-    DYNARRAY(token_t) args;
+    SMALL_DYNARRAY(token_t, 4) args;
     token_list_t macro_tokens;
+    int* body_params; // per body token : the index of the parameter it names, or one of the MACRO_BODY_* values
+    int stringifies; // the body stringifies one of the parameters
 } macro_def_t;
 
 typedef enum lexer_flags
@@ -125,26 +177,17 @@ typedef enum lexer_flags
     LEX_SINGLE_TOKEN = (1<<3)
 } lexer_flags;
 
-static inline int is_newline(const char* ptr)
-{
-    return *ptr == '\n' || strncmp(ptr, "\r\n", 2) == 0;
-}
-static inline void skip_newline(const char** ptr)
-{
-    if (strncmp(*ptr, "\r\n", 2) == 0 || strncmp(*ptr, "\n\r", 2) == 0)
-        *ptr += 2;
-    else
-        ++*ptr;
-}
-
-// returns owned pointer
-void tokenize_program(token_list_t* tokens, const char* source, const char* filename);
+// tokenizes the source repeatedly for about a second, and prints the lexer throughput
+void benchmark_lexer(const char* source, size_t source_size, const char* filename);
 
 const char* match_identifier(const char* ptr, token_t* tok);
+const char* match_word(const char* ptr, token_t* tok);
 const char* match_number_literal(const char* ptr, token_t* tok);
 const char* match_string_literal(const char* ptr, token_t* tok);
-const char* match_delimiter(const char* ptr, token_t* tok);
+const char* match_punctuator(const char* ptr, token_t* tok);
 const char *do_tokenization(token_list_t* tokens, source_location_t* loc, int flags);
+// skips the comment starting at 'ptr', returns NULL if there is none
+const char* consume_comment(const char* ptr);
 
 // returns 1 if it's on a new line
 static inline int skip_whitespace(source_location_t* loc, int consume_newlines)
@@ -152,14 +195,15 @@ static inline int skip_whitespace(source_location_t* loc, int consume_newlines)
     int on_new_line = 0;
 
     // skip all whitespace
-    while (isspace(*loc->ptr) || (*loc->ptr == '\\' && is_newline(loc->ptr+1)))
+    while (is_space_char(*loc->ptr) || *loc->ptr == '\\')
     {
+        loc->ptr = scan_blanks(loc->ptr, consume_newlines, &on_new_line);
+
         if (*loc->ptr == '\\' && is_newline(loc->ptr+1))
         {
             ++loc->ptr; // skip to newline
 
             skip_newline(&loc->ptr);
-            update_loc_newline(loc, loc->ptr);
         }
         else if (is_newline(loc->ptr))
         {
@@ -168,12 +212,13 @@ static inline int skip_whitespace(source_location_t* loc, int consume_newlines)
                 break;
 
             skip_newline(&loc->ptr);
-            update_loc_newline(loc, loc->ptr);
         }
-        else
+        else if (is_space_char(*loc->ptr))
         {
             ++loc->ptr;
         }
+        else
+            break;
     }
 
     return on_new_line;
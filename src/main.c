@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "lexer.h"
+#include "token_stream.h"
 #include "parser.h"
 #include "ast_printer.h"
 #include "code_generator.h"
@@ -10,10 +12,13 @@
 #include "asm_optimizer.h"
 #include "code_printer.h"
 #include "preprocessor.h"
+#include "pp_output.h"
 #include "alloc.h"
 #include "builtin.h"
 #include "file_read.h"
 
+#define ALLOC_TAG ALLOC_TAG_CURRENT
+
 // TODO : mixin ! should be simple to implement
 // TODO : implement mutable inplace operators
 // TODO : have a 'primexpr_to_expr' type returning an initialized 'expression_t*'
@@ -35,58 +40,219 @@ const char* example_program = ""
                               "} while (val != 1);\n"
                               "}";
 
-int main()
+int main(int argc, char** argv)
 {
     // don't use danpa_alloc, fool ! cleanup_memory will mess up the output !
     setvbuf(stdout, malloc(16384), _IOFBF, 16384); // fully buffered stdout
 
-    clock_t time_start, time_end;
-    time_start = clock();
-
     const char* filename = "tests.dps";
     //const char* filename = "program_shell.dps";
     //const char* filename = "program_linkedlist.dps";
+
+    int mem_report = 0;
+    int lex_bench = 0;
+    int parse_bench = 0;
+    int preprocess_only = 0;
+    const char* pch_header = NULL;
     const char* out_name = "D:/Compiegne C++/Projets C++/DanpaAssembler/build/asm.dpa";
+    int out_name_given = 0;
+    int write_deps = 0;
+    const char* deps_name = NULL;
+    const char* deps_target = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--mem-report") == 0)
+            mem_report = 1;
+        else if (strcmp(argv[i], "--lex-bench") == 0)
+            lex_bench = 1;
+        else if (strcmp(argv[i], "--parse-bench") == 0)
+            parse_bench = 1;
+        else if (strcmp(argv[i], "--pch") == 0 && i+1 < argc) // build the precompiled header of the given header
+            pch_header = argv[++i];
+        else if (strcmp(argv[i], "-E") == 0) // only preprocess, the output goes to stdout unless -o is given
+            preprocess_only = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i+1 < argc)
+        {
+            out_name = argv[++i];
+            out_name_given = 1;
+        }
+        else if (strcmp(argv[i], "-MD") == 0) // write the included files as a make rule, to <input>.d unless -MF is given
+            write_deps = 1;
+        else if (strcmp(argv[i], "-MF") == 0 && i+1 < argc)
+        {
+            deps_name = argv[++i];
+            write_deps = 1;
+        }
+        else if (strcmp(argv[i], "-MT") == 0 && i+1 < argc) // the target of the rule, the -o output or <input>.dpa by default
+            deps_target = argv[++i];
+        else if (strcmp(argv[i], "-") == 0 || argv[i][0] != '-') // input file, '-' for stdin
+            filename = argv[i];
+        else
+        {
+            fprintf(stderr, "unknown option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (mem_report)
+        enable_alloc_profiling();
 
-    const char* source_buffer = (const char*)read_file(filename);
+    clock_t time_start, time_end;
+    time_start = clock();
+
+    set_alloc_stage(ALLOC_TAG_LEXER);
+
+    if (pch_header)
+    {
+        init_pp();
+        set_alloc_region(REGION_LEXER);
+        const int success = build_precompiled_header(pch_header);
+        close_source_files();
+        cleanup_memory();
+        fflush(stdout);
+        return success ? 0 : -1;
+    }
+
+    size_t source_size;
+    const char* source_buffer = (const char*)read_file(filename, &source_size);
     if (!source_buffer)
     {
         fprintf(stderr, "could not read input file '%s'", filename);
         return -1;
     }
+    // the dependencies are listed as they are resolved : the rule is written once the program is preprocessed
+    const char* deps_input = strcmp(filename, "-") == 0 ? NULL : filename;
+    char deps_default_name[4096];
+    char deps_default_target[4096];
+    if (write_deps)
+    {
+        // the defaults are named after the input, with its extension replaced
+        const char* input = deps_input ? deps_input : "stdin";
+        const char* extension = strrchr(input, '.');
+        if (!extension || strchr(extension, '/'))
+            extension = input + strlen(input);
+        const int stem_length = (int)(extension - input);
+        if (!deps_name)
+        {
+            snprintf(deps_default_name, sizeof(deps_default_name), "%.*s.d", stem_length, input);
+            deps_name = deps_default_name;
+        }
+        // the built-in output path isn't a make target
+        if (!deps_target && out_name_given)
+            deps_target = out_name;
+        else if (!deps_target)
+        {
+            snprintf(deps_default_target, sizeof(deps_default_target), "%.*s.dpa", stem_length, input);
+            deps_target = deps_default_target;
+        }
+    }
+
+    if (strcmp(filename, "-") == 0)
+        filename = "<stdin>";
+
+    if (lex_bench)
+    {
+        benchmark_lexer(source_buffer, source_size, filename);
+        close_source_files();
+        cleanup_memory();
+        fflush(stdout);
+        return 0;
+    }
+
+    if (parse_bench)
+    {
+        init_builtins();
+        benchmark_parser(source_buffer, source_size, filename);
+        close_source_files();
+        cleanup_memory();
+        fflush(stdout);
+        return 0;
+    }
 
     init_pp();
+
+    if (preprocess_only)
+    {
+        FILE* output = out_name_given ? fopen(out_name, "wb") : stdout;
+        if (!output)
+        {
+            fprintf(stderr, "could not open output file '%s'", out_name);
+            return -1;
+        }
+
+        set_alloc_region(REGION_LEXER);
+        init_token_stream(add_source_file(filename, source_buffer, source_size));
+        write_preprocessed(output);
+        if (write_deps && !write_dependencies(deps_name, deps_target, deps_input))
+        {
+            fprintf(stderr, "could not write dependency file '%s'\n", deps_name);
+            return -1;
+        }
+
+        if (output != stdout)
+            fclose(output);
+        if (mem_report)
+            print_memory_report(output == stdout ? stderr : stdout);
+        close_source_files();
+        // its summary would end up in the output
+        if (output != stdout)
+            cleanup_memory();
+        fflush(stdout);
+        return 0;
+    }
+
     init_builtins();
 
-    token_list_t tokens;
-    DYNARRAY_INIT(tokens, 1024);
-    tokenize_program(&tokens, source_buffer, filename);
-    token_t eof;
-    eof.type = TOKEN_EOF;
-    DYNARRAY_ADD(tokens, eof);
+    set_alloc_region(REGION_LEXER);
+
+    // the program is lexed as the parser reads it
+    init_token_stream(add_source_file(filename, source_buffer, source_size));
 
-    set_parser_token_list(tokens.ptr);
+    set_alloc_region(REGION_AST);
+    set_alloc_stage(ALLOC_TAG_PARSER);
 
     types_init();
 
     program_t prog;
     parse_program(&prog);
 
+    if (write_deps && !write_dependencies(deps_name, deps_target, deps_input))
+    {
+        fprintf(stderr, "could not write dependency file '%s'\n", deps_name);
+        return -1;
+    }
+
+    // the AST doesn't reference the token stream anymore
+    release_region(REGION_LEXER);
+
+    set_alloc_stage(ALLOC_TAG_SEMANTIC);
     semanal_program(&prog);
+    set_alloc_stage(ALLOC_TAG_AST_OPTIMIZER);
     for (int i = 0; i < 15; ++i) // multiple ast optimization passes
          ast_optimize_program(&prog);
 
+    set_alloc_stage(ALLOC_TAG_OTHER);
     print_program(&prog);
 
     FILE* output = fopen(out_name, "wb");
 
+    set_alloc_region(REGION_IR);
+    set_alloc_stage(ALLOC_TAG_CODEGEN);
+
     generate_program(&prog);
+    release_region(REGION_AST);
+
+    set_alloc_stage(ALLOC_TAG_ASM_OPTIMIZER);
     for (int i = 0; i < 15; ++i) // multiple asm optimization passes
         optimize_asm(instruction_list);
 
+    set_alloc_stage(ALLOC_TAG_OTHER);
     print_code_output(instruction_list, output);
 
     fclose(output);
+    if (mem_report)
+        print_memory_report(stdout);
+    close_source_files();
     cleanup_memory();
 
     time_end = clock();
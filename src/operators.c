@@ -8,6 +8,8 @@
 #include "ast_nodes.h"
 #include "error.h"
 
+#define ALLOC_TAG ALLOC_TAG_CURRENT
+
     operator_t operators[OP_ENUM_END] =
         {
           // str  stra  prec  bool  logic category
@@ -146,6 +148,11 @@ float eval_float_binop(operator_type_t op, float x, float y)
     return 0.0f;
 }
 
+void clear_overloads()
+{
+    DYNARRAY_INIT(overloads, 0);
+}
+
 void register_overload(function_t *func)
 {
     assert(func->is_operator_overload);
@@ -154,7 +161,8 @@ void register_overload(function_t *func)
     op_overload_t* overload = &overloads.ptr[overloads.size-1];
     overload->op = func->overloaded_op;
     overload->signature.ret_type = func->signature.ret_type;
-    DYNARRAY_INIT(overload->signature.parameter_types, 2);
+    SMALL_DYNARRAY_INIT(overload->signature.parameter_types);
+    const type_t* param_types = SMALL_DYNARRAY_DATA(func->signature.parameter_types);
 
     // binop
     // OP_CAT is ambiguous
@@ -162,49 +170,48 @@ void register_overload(function_t *func)
         || (func->overloaded_op == OP_CAT && func->signature.parameter_types.size == 2))
     {
         if (func->signature.parameter_types.size != 2)
-            error(func->name->location, func->name->length, "invalid operator overload argument count\n");
+            error(*token_loc(func->name), func->name->length, "invalid operator overload argument count\n");
 
         // only POD types : this is a non-overloadable operator
-        if (!is_struct(&func->signature.ret_type) && !is_struct(&func->signature.parameter_types.ptr[0])
-            && !is_struct(&func->signature.parameter_types.ptr[1]))
+        if (!is_struct(&func->signature.ret_type) && !is_struct(&param_types[0])
+            && !is_struct(&param_types[1]))
         {
-            error(func->name->location, func->name->length, "can't overload operator%s with types %s, %s, %s\n", operators[func->overloaded_op].str,
+            error(*token_loc(func->name), func->name->length, "can't overload operator%s with types %s, %s, %s\n", operators[func->overloaded_op].str,
                   type_to_str(&func->signature.ret_type),
-                  type_to_str(&func->signature.parameter_types.ptr[0]), type_to_str(&func->signature.parameter_types.ptr[1]));
+                  type_to_str(&param_types[0]), type_to_str(&param_types[1]));
         }
 
-        DYNARRAY_ADD(overload->signature.parameter_types, func->signature.parameter_types.ptr[0]);
-        DYNARRAY_ADD(overload->signature.parameter_types, func->signature.parameter_types.ptr[1]);
+        SMALL_DYNARRAY_ADD(overload->signature.parameter_types, param_types[0]);
+        SMALL_DYNARRAY_ADD(overload->signature.parameter_types, param_types[1]);
         snprintf(overload->mangled_name, 256, "operatorb%s_%s_%s", operators[func->overloaded_op].str_alpha,
-                 type_to_str(&func->signature.parameter_types.ptr[0]), type_to_str(&func->signature.parameter_types.ptr[1]));
+                 type_to_str(&param_types[0]), type_to_str(&param_types[1]));
 
-        assert(find_binop_overload(func->overloaded_op, &func->signature.parameter_types.ptr[0], &func->signature.parameter_types.ptr[1]));
+        assert(find_binop_overload(func->overloaded_op, &param_types[0], &param_types[1]));
     }
     // unary op
     else if ((func->overloaded_op != OP_CAT && operators[func->overloaded_op].category == OPC_UNARY)
              || (func->overloaded_op == OP_CAT && func->signature.parameter_types.size == 1))
     {
         if (func->signature.parameter_types.size != 1)
-            error(func->name->location, func->name->length, "invalid operator overload argument count\n");
+            error(*token_loc(func->name), func->name->length, "invalid operator overload argument count\n");
 
         // only POD types : this is a non-overloadable operator
-        if (!is_struct(&func->signature.ret_type) && !is_struct(&func->signature.parameter_types.ptr[0]))
+        if (!is_struct(&func->signature.ret_type) && !is_struct(&param_types[0]))
         {
-            error(func->name->location, func->name->length, "can't overload operator%s with types %s, %s\n", operators[func->overloaded_op].str,
+            error(*token_loc(func->name), func->name->length, "can't overload operator%s with types %s, %s\n", operators[func->overloaded_op].str,
                   type_to_str(&func->signature.ret_type),
-                  type_to_str(&func->signature.parameter_types.ptr[0]));
+                  type_to_str(&param_types[0]));
         }
 
-        DYNARRAY_ADD(overload->signature.parameter_types, func->signature.parameter_types.ptr[0]);
-        snprintf(overload->mangled_name, 256, "operatoru%s_%s", operators[func->overloaded_op].str_alpha, type_to_str(&func->signature.parameter_types.ptr[0]));
+        SMALL_DYNARRAY_ADD(overload->signature.parameter_types, param_types[0]);
+        snprintf(overload->mangled_name, 256, "operatoru%s_%s", operators[func->overloaded_op].str_alpha, type_to_str(&param_types[0]));
 
-        assert(find_unop_overload(func->overloaded_op, &func->signature.parameter_types.ptr[0]));
+        assert(find_unop_overload(func->overloaded_op, &param_types[0]));
     }
     else
         assert("invalid op" && 0);
 
-    func->name->data.str = danpa_alloc(strlen((const char*)overload->mangled_name));
-    strcpy((char*)func->name->data.str, overload->mangled_name);
+    func->name->data.str = intern_string(overload->mangled_name, strlen(overload->mangled_name));
 }
 
 op_overload_t *find_binop_overload(operator_type_t op, const type_t *lhs_type, const type_t *rhs_type)
@@ -212,8 +219,8 @@ op_overload_t *find_binop_overload(operator_type_t op, const type_t *lhs_type, c
     for (int i = 0; i < overloads.size; ++i)
     {
         if (overloads.ptr[i].op == op && overloads.ptr[i].signature.parameter_types.size == 2
-            && cmp_types(&overloads.ptr[i].signature.parameter_types.ptr[0], lhs_type)
-            && cmp_types(&overloads.ptr[i].signature.parameter_types.ptr[1], rhs_type))
+            && cmp_types(&SMALL_DYNARRAY_DATA(overloads.ptr[i].signature.parameter_types)[0], lhs_type)
+            && cmp_types(&SMALL_DYNARRAY_DATA(overloads.ptr[i].signature.parameter_types)[1], rhs_type))
         {
             return &overloads.ptr[i];
         }
@@ -226,7 +233,7 @@ op_overload_t *find_unop_overload(operator_type_t op, const type_t *type)
     for (int i = 0; i < overloads.size; ++i)
     {
         if (overloads.ptr[i].op == op && overloads.ptr[i].signature.parameter_types.size == 1
-            && cmp_types(&overloads.ptr[i].signature.parameter_types.ptr[0], type))
+            && cmp_types(&SMALL_DYNARRAY_DATA(overloads.ptr[i].signature.parameter_types)[0], type))
         {
             return &overloads.ptr[i];
         }
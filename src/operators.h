@@ -68,6 +68,8 @@ typedef struct function_signature_t function_signature_t;
 typedef struct type_t type_t;
 
 void register_overload(function_t *func);
+// forgets the registered overloads, the memory of the table is left to its region
+void clear_overloads();
 op_overload_t *find_binop_overload(operator_type_t op, const type_t* lhs_type, const type_t* rhs_type);
 op_overload_t *find_unop_overload(operator_type_t op, const type_t* type);
 
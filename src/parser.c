@@ -25,61 +25,32 @@ Copyright (c) 15 Yann BOUCHER (yann)
 
 #include "parser.h"
 #include "lexer.h"
+#include "token_stream.h"
 #include "error.h"
 #include "alloc.h"
 #include "builtin.h"
+#include "preprocessor.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <setjmp.h>
+#include <time.h>
 
-        static token_t* tokens;
+#define ALLOC_TAG ALLOC_TAG_PARSER
+
+static int token_pos; // position in the token stream
 static token_t* prev_token_val = NULL;
 static program_t*  current_program  = NULL;
-
-#define REWIND_BEGIN(scope_name) \
-    int scope_name##_rewind_status = 0;\
-    DYNARRAY_ADD(rewind_stack, (rewind_data_t){}); \
-    rewind_stack.ptr[rewind_stack.size-1].tokens = tokens; \
-    rewind_stack.ptr[rewind_stack.size-1].prev_token = prev_token_val; \
-    if (setjmp(rewind_stack.ptr[rewind_stack.size-1].jmp_restore) != 0) \
-    { \
-        scope_name##_rewind_status = 1; \
-        goto scope_name##_rewind_out; \
-    } \
-
-#define REWIND_END(scope_name) \
-    scope_name##_rewind_out: \
-    assert(rewind_stack.size > 0); \
-    tokens = rewind_stack.ptr[rewind_stack.size-1].tokens; \
-    prev_token_val = rewind_stack.ptr[rewind_stack.size-1].prev_token; \
-    DYNARRAY_POP(rewind_stack);
-
-#define REWIND_FAILED(scope_name) scope_name##_rewind_status
-
-typedef struct rewind_data_t
-{
-    token_t* tokens;
-    token_t* prev_token;
-    jmp_buf  jmp_restore;
-} rewind_data_t;
-
-static DYNARRAY(rewind_data_t) rewind_stack;
+static int local_declaration_count; // local variables and temporaries needed by the function being parsed
 
 int is_binop(int op)
 {
     return operators[op].category == OPC_BINARY;
 }
 
-void set_parser_token_list(token_t *token_list)
-{
-    tokens = token_list;
-}
-
 token_t* next_token()
 {
-    return tokens;
+    return stream_token(token_pos);
 }
 
 token_t* prev_token()
@@ -89,19 +60,52 @@ token_t* prev_token()
 
 token_t* forward(int n)
 {
-    for (int i = 0; i < n; ++i)
-    {
-        if (tokens[i].type == TOKEN_EOF)
-            return &tokens[i];
-    }
-
-    return &tokens[n];
+    // the EOF token is returned past the end
+    return stream_token(token_pos + n);
 }
 
 token_t* consume_token()
 {
-    prev_token_val = tokens;
-    return tokens++;
+    prev_token_val = stream_token(token_pos++);
+    return prev_token_val;
+}
+
+// the token list is released after parsing : tokens referenced by the AST must be copied out of it
+static token_t* retain_token(token_t* tok)
+{
+    if (tok == NULL)
+        return NULL;
+
+    token_t* copy = (token_t*)danpa_alloc(sizeof(token_t));
+    *copy = *tok;
+    return copy;
+}
+
+// estimates the statement count of the block starting at the current token, in order to size its statement list :
+// counts the semicolons and the nested blocks at the top level of the block
+static int estimate_block_size()
+{
+    int count = 0;
+    int brace_depth = 0, parenthesis_depth = 0;
+    for (int i = token_pos; ; ++i)
+    {
+        const token_t* tok = stream_token(i);
+        if (tok->type == TOKEN_EOF)
+            break;
+
+        if (tok->type == TOK_OPEN_PARENTHESIS)
+            ++parenthesis_depth;
+        else if (tok->type == TOK_CLOSE_PARENTHESIS)
+            --parenthesis_depth;
+        else if (tok->type == TOK_OPEN_BRACE && brace_depth++ == 0)
+            ++count;
+        else if (tok->type == TOK_CLOSE_BRACE && brace_depth-- == 0)
+            break;
+        else if (tok->type == TOK_SEMICOLON && brace_depth == 0 && parenthesis_depth == 0)
+            ++count;
+    }
+
+    return count;
 }
 
 token_t* accept(token_type_t type)
@@ -134,12 +138,7 @@ token_t* expect(token_type_t type)
 {
     token_t* cur_tok = next_token();
     if (cur_tok->type != type)
-    {
-        if (rewind_stack.size) // rewind
-            longjmp(rewind_stack.ptr[rewind_stack.size-1].jmp_restore, 1);
-        else
-            error(cur_tok->location, cur_tok->length, "expected '%s', got '%s'\n", tokens_str[type], tokens_str[cur_tok->type]);
-    }
+        error(*token_loc(cur_tok), cur_tok->length, "expected '%s', got '%s'\n", tokens_str[type], tokens_str[cur_tok->type]);
 
     consume_token();
 
@@ -150,12 +149,7 @@ token_t* expect_op(operator_type_t op)
 {
     token_t* cur_tok = next_token();
     if (cur_tok->type != TOK_OPERATOR || cur_tok->data.op != op)
-    {
-        if (rewind_stack.size) // rewind
-            longjmp(rewind_stack.ptr[rewind_stack.size-1].jmp_restore, 1);
-        else
-            error(cur_tok->location, cur_tok->length, "expected '%s', got '%s'\n", operators[op].str, tokens_str[cur_tok->type]);
-    }
+        error(*token_loc(cur_tok), cur_tok->length, "expected '%s', got '%s'\n", operators[op].str, tokens_str[cur_tok->type]);
 
     consume_token();
 
@@ -179,7 +173,7 @@ static int has_function(const char* str)
     for (int i = 0; i < current_program->function_list.size; ++i)
     {
         function_t* item = &current_program->function_list.ptr[i];
-        if (strcmp(item->name->data.str, str) == 0)
+        if (item->name->data.str == str)
         {
             return 1;
         }
@@ -191,12 +185,12 @@ void parse_expr(expression_t* expr, int p);
 
 void parse_type(type_t* type)
 {
-    token_t* base_type_tok = expect(TOK_IDENTIFIER);
+    token_t* base_type_tok = retain_token(expect(TOK_IDENTIFIER));
     *type = get_type(base_type_tok->data.str);  // base type
     type->token = base_type_tok;
 
     if (type->base_type == INVALID_TYPE)
-        error(base_type_tok->location, strlen(base_type_tok->data.str), "Invalid type '%s'\n", base_type_tok->data.str);
+        error(*token_loc(base_type_tok), strlen(base_type_tok->data.str), "Invalid type '%s'\n", base_type_tok->data.str);
 
     // the fun stuff : interpret pointer and array declarators
     for(;;)
@@ -209,7 +203,7 @@ void parse_type(type_t* type)
             *base_type = *type;
             type->kind = POINTER;
             type->pointer.pointed_type = base_type;
-            type->token = tok;
+            type->token = retain_token(tok);
         }
         // is an optional
         else if ((tok = accept(TOK_QUESTION))) // '?'
@@ -218,7 +212,7 @@ void parse_type(type_t* type)
             *base_type = *type;
             type->kind = OPTIONAL;
             type->opt.opt_type = base_type;
-            type->token = tok;
+            type->token = retain_token(tok);
         }
         // is an array
         else if ((tok = accept(TOK_OPEN_BRACKET)))
@@ -226,7 +220,7 @@ void parse_type(type_t* type)
             type_t* base_type = (type_t*)danpa_alloc(sizeof(type_t));
             *base_type = *type;
             type->kind = ARRAY;
-            type->token = tok;
+            type->token = retain_token(tok);
             type->array.array_type = base_type;
             type->array.initial_size = NULL;
             if (next_token()->type != TOK_CLOSE_BRACKET)
@@ -265,13 +259,13 @@ void parse_type(type_t* type)
 
         sig->ret_type = *ret_type;
 
-        DYNARRAY_INIT(sig->parameter_types, 4);
+        SMALL_DYNARRAY_INIT(sig->parameter_types);
         do
         {
             type_t param;
             parse_type(&param);
 
-            DYNARRAY_ADD(sig->parameter_types, param);
+            SMALL_DYNARRAY_ADD(sig->parameter_types, param);
 
             // another parameter
             if (next_token()->type != TOK_CLOSE_PARENTHESIS)
@@ -288,18 +282,6 @@ void parse_type(type_t* type)
     }
 }
 
-int maybe_parse_type()
-{
-    REWIND_BEGIN(maybe_type);
-
-    type_t type;
-    parse_type(&type);
-
-    REWIND_END(maybe_type);
-
-    return REWIND_FAILED(maybe_type) == 0;
-}
-
 void parse_variable_type(type_t* type)
 {
     token_t* base_type_tok = next_token();
@@ -307,7 +289,7 @@ void parse_variable_type(type_t* type)
 
     type_t void_type = mk_type(VOID);
     if (cmp_types(type, &void_type))
-        error(base_type_tok->location, strlen(base_type_tok->data.str), "a variable cannot have the type 'void'\n", base_type_tok->data.str);
+        error(*token_loc(base_type_tok), strlen(base_type_tok->data.str), "a variable cannot have the type 'void'\n", base_type_tok->data.str);
 }
 
 void parse_func_parameters(function_call_t* func_call)
@@ -329,13 +311,13 @@ void parse_func_parameters(function_call_t* func_call)
     }
 
     token_t* tok = expect(TOK_CLOSE_PARENTHESIS);
-    func_call->length = tok->location.ptr - func_call->call_expr->loc.ptr;
+    func_call->length = token_loc(tok)->ptr - func_call->call_expr->loc.ptr;
 }
 
 void parse_match_pattern(match_pattern_t* match_pattern)
 {
     token_t* tok;
-    match_pattern->loc = next_token()->location;
+    match_pattern->loc = *token_loc(next_token());
 
     if ((tok = accept(TOK_INTEGER_LITERAL)))
     {
@@ -344,38 +326,38 @@ void parse_match_pattern(match_pattern_t* match_pattern)
         {
             tok2 = expect(TOK_INTEGER_LITERAL);
 
-            match_pattern->left_bound = tok;
-            match_pattern->right_bound = tok2;
+            match_pattern->left_bound = retain_token(tok);
+            match_pattern->right_bound = retain_token(tok2);
             match_pattern->type = PAT_RANGE;
         }
         else
         {
-            match_pattern->int_constant = tok;
+            match_pattern->int_constant = retain_token(tok);
             match_pattern->type = PAT_INT_LIT;
         }
     }
     else if ((tok = accept(TOK_STRING_LITERAL)))
     {
-        match_pattern->string_lit = tok;
+        match_pattern->string_lit = retain_token(tok);
         match_pattern->type = PAT_STR_LIT;
     }
     else if ((tok = accept(TOK_IDENTIFIER)))
     {
-        match_pattern->ident.name = tok;
+        match_pattern->ident.name = retain_token(tok);
         match_pattern->ident.flags = 0;
         match_pattern->type = PAT_IDENT;
     }
     else
     {
-        error(next_token()->location, next_token()->length, "expected pattern\n");
+        error(*token_loc(next_token()), next_token()->length, "expected pattern\n");
     }
 
-    match_pattern->length = prev_token()->location.ptr + prev_token()->length - match_pattern->loc.ptr;
+    match_pattern->length = token_loc(prev_token())->ptr + prev_token()->length - match_pattern->loc.ptr;
 }
 
 void parse_match_case(match_case_t* match_case)
 {
-    DYNARRAY_INIT(match_case->patterns, 4);
+    SMALL_DYNARRAY_INIT(match_case->patterns);
     match_case->expr = danpa_alloc(sizeof(expression_t));
 
     if (next_token()->type == TOK_IDENTIFIER && strcmp(next_token()->data.str, "_"))
@@ -391,17 +373,17 @@ void parse_match_case(match_case_t* match_case)
             match_pattern_t pattern;
             parse_match_pattern(&pattern);
 
-            DYNARRAY_ADD(match_case->patterns, pattern);
+            SMALL_DYNARRAY_ADD(match_case->patterns, pattern);
         } while (accept_op(OP_BITOR));
     }
 
-    match_case->loc = match_case->patterns.ptr[0].loc;
+    match_case->loc = SMALL_DYNARRAY_DATA(match_case->patterns)[0].loc;
 
     expect(TOK_MATCH_OP);
 
     parse_expr(match_case->expr, 0);
 
-    match_case->length = prev_token()->location.ptr + prev_token()->length -  match_case->loc.ptr;
+    match_case->length = token_loc(prev_token())->ptr + prev_token()->length -  match_case->loc.ptr;
 }
 
 void parse_prim_expr(primary_expression_t* value);
@@ -411,7 +393,7 @@ void parse_incdec(token_t* tok, primary_expression_t* value)
     parse_prim_expr(assigned_expr);
 
     assignment_t* assignment = (assignment_t*)danpa_alloc(sizeof(assignment_t));
-    assignment->eq_token = tok;
+    assignment->eq_token = retain_token(tok);
     assignment->var = *assigned_expr;
 
     expression_t* right = (expression_t*)danpa_alloc(sizeof(expression_t));
@@ -447,7 +429,7 @@ void parse_incdec(token_t* tok, primary_expression_t* value)
 
 void parse_array_lit(array_lit_expr_t* value)
 {
-    value->loc = next_token()->location;
+    value->loc = *token_loc(next_token());
     DYNARRAY_INIT(value->elements, 16);
 
     expect(TOK_OPEN_BRACE);
@@ -465,14 +447,14 @@ void parse_array_lit(array_lit_expr_t* value)
             }
         }
 
-    value->length = prev_token()->location.ptr - value->loc.ptr;
+    value->length = token_loc(prev_token())->ptr - value->loc.ptr;
 }
 
 void parse_prim_expr(primary_expression_t* value)
 {
     token_t* tok;
     token_t* first_tok = next_token();
-    value->loc = first_tok->location;
+    value->loc = *token_loc(first_tok);
 
     if ((tok = accept(TOK_OPEN_PARENTHESIS)))
     {
@@ -480,7 +462,7 @@ void parse_prim_expr(primary_expression_t* value)
         {
             parse_type(&value->cast_expr.target_type);
             value->type = CAST_EXPRESSION;
-            value->cast_expr.cast_type_token = tok;
+            value->cast_expr.cast_type_token = retain_token(tok);
             expect(TOK_CLOSE_PARENTHESIS);
 
             value->cast_expr.expr = (primary_expression_t*)danpa_alloc(sizeof(primary_expression_t));
@@ -531,7 +513,7 @@ void parse_prim_expr(primary_expression_t* value)
         parse_prim_expr(expr);
 
         value->type = POINTER_DEREF;
-        value->deref.asterisk_token = tok;
+        value->deref.asterisk_token = retain_token(tok);
         value->deref.pointer_expr = expr;
     }
     else if ((tok = accept_op(OP_BITAND)))
@@ -540,7 +522,7 @@ void parse_prim_expr(primary_expression_t* value)
         parse_prim_expr(expr);
 
         value->type = ADDR_GET;
-        value->addr.addr_token = tok;
+        value->addr.addr_token = retain_token(tok);
         value->addr.addr_expr = expr;
     }
     else if ((tok = accept_op(OP_ADD)) || (tok = accept_op(OP_SUB)) || (tok = accept_op(OP_LOGICNOT)) || (tok = accept_op(OP_BITNOT))
@@ -550,7 +532,7 @@ void parse_prim_expr(primary_expression_t* value)
         parse_prim_expr(unary_op_factor);
 
         value->type = UNARY_OP_FACTOR;
-        value->unary_expr.unary_op = tok;
+        value->unary_expr.unary_op = retain_token(tok);
         value->unary_expr.unary_value = unary_op_factor;
     }
     else if (accept_op(OP_MOD)) // '%' token
@@ -598,13 +580,13 @@ void parse_prim_expr(primary_expression_t* value)
         expect(TOK_CLOSE_PARENTHESIS);
 
         value->type = ASM_EXPR;
-        value->asm_expr.asm_code = code->data.str;
+        value->asm_expr.asm_code = string_literal_str(code);
     }
     else if (accept(KEYWORD_SIZEOF))
     {
-        value->sizeof_expr.loc = next_token()->location;
+        value->sizeof_expr.loc = *token_loc(next_token());
         expect(TOK_OPEN_PARENTHESIS);
-        if (maybe_parse_type())
+        if (token_is_type(next_token()))
         {
             parse_type(&value->sizeof_expr.type);
             value->sizeof_expr.is_expr = 0;
@@ -617,25 +599,26 @@ void parse_prim_expr(primary_expression_t* value)
             value->sizeof_expr.is_expr = 1;
         }
         expect(TOK_CLOSE_PARENTHESIS);
-        value->sizeof_expr.length = prev_token()->location.ptr - value->sizeof_expr.loc.ptr;
+        value->sizeof_expr.length = token_loc(prev_token())->ptr - value->sizeof_expr.loc.ptr;
 
         value->type = SIZEOF_EXPR;
     }
     else if (accept(KEYWORD_NEW))
     {
-        value->new_expr.loc = next_token()->location;
+        value->new_expr.loc = *token_loc(next_token());
 
         type_t type;
         parse_type(&type);
 
         value->type = NEW_EXPR;
         value->new_expr.new_type = type;
-        value->new_expr.length = prev_token()->location.ptr - value->new_expr.loc.ptr;
+        value->new_expr.length = token_loc(prev_token())->ptr - value->new_expr.loc.ptr;
     }
     else if (accept(KEYWORD_MATCH))
     {
         expect(TOK_OPEN_PARENTHESIS);
         value->match_expr.tested_expr = danpa_alloc(sizeof(expression_t));
+        ++local_declaration_count; // tested expression temporary
         parse_expr(value->match_expr.tested_expr, 0);
         expect(TOK_CLOSE_PARENTHESIS);
         expect(TOK_OPEN_BRACE);
@@ -663,7 +646,7 @@ void parse_prim_expr(primary_expression_t* value)
             // struct initializer
             value->type = STRUCT_INIT;
             value->struct_init.type = type;
-            value->struct_init.loc = tok->location;
+            value->struct_init.loc = *token_loc(tok);
 
             expect(TOK_OPEN_PARENTHESIS);
             DYNARRAY_INIT(value->struct_init.elements, 8);
@@ -681,34 +664,34 @@ void parse_prim_expr(primary_expression_t* value)
                     accept(TOK_COMMA);
             } while (1);
 
-            value->struct_init.length = (prev_token()->location.ptr+prev_token()->length) - value->struct_init.loc.ptr;
+            value->struct_init.length = (token_loc(prev_token())->ptr+prev_token()->length) - value->struct_init.loc.ptr;
         }
         else
         {
             value->type = IDENT;
-            value->ident.name = tok;
+            value->ident.name = retain_token(tok);
             value->ident.flags = 0;
         }
     }
     else if ((tok = accept(TOK_INTEGER_LITERAL)))
     {
         value->type = INT_CONSTANT;
-        value->int_constant = tok;
+        value->int_constant = retain_token(tok);
     }
     else if ((tok = accept(TOK_FLOAT_LITERAL)))
     {
         value->type = FLOAT_CONSTANT;
-        value->flt_constant = tok;
+        value->flt_constant = retain_token(tok);
     }
     else if ((tok = accept(TOK_STRING_LITERAL)))
     {
         value->type = STRING_LITERAL;
-        value->string_lit = tok;
+        value->string_lit = retain_token(tok);
     }
     else
     {
         tok = next_token();
-        error(tok->location, 1, "expected expression got '%s'\n", tokens_str[tok->type]);
+        error(*token_loc(tok), 1, "expected expression got '%s'\n", tokens_str[tok->type]);
     }
 
     // array subscript
@@ -728,9 +711,9 @@ void parse_prim_expr(primary_expression_t* value)
                 expect(TOK_CLOSE_BRACKET);
 
                 *expr_within = *value;
-                expr_within->length = last_token->location.ptr - first_tok->location.ptr;
+                expr_within->length = token_loc(last_token)->ptr - token_loc(first_tok)->ptr;
                 value->type = ARRAY_SLICE;
-                value->array_slice.bracket_token = tok;
+                value->array_slice.bracket_token = retain_token(tok);
                 value->array_slice.array_expr = expr_within;
                 value->array_slice.left_expr = sub_expr;
                 value->array_slice.right_expr = right_expr;
@@ -740,9 +723,9 @@ void parse_prim_expr(primary_expression_t* value)
                 expect(TOK_CLOSE_BRACKET);
 
                 *expr_within = *value;
-                expr_within->length = last_token->location.ptr - first_tok->location.ptr;
+                expr_within->length = token_loc(last_token)->ptr - token_loc(first_tok)->ptr;
                 value->type = ARRAY_SUBSCRIPT;
-                value->array_sub.bracket_token = tok;
+                value->array_sub.bracket_token = retain_token(tok);
                 value->array_sub.array_expr = expr_within;
                 value->array_sub.subscript_expr = sub_expr;
             }
@@ -751,7 +734,7 @@ void parse_prim_expr(primary_expression_t* value)
         {
             primary_expression_t* expr_within = (primary_expression_t*)danpa_alloc(sizeof(primary_expression_t));
             *expr_within = *value;
-            expr_within->length = last_token->location.ptr - first_tok->location.ptr;
+            expr_within->length = token_loc(last_token)->ptr - token_loc(first_tok)->ptr;
 
             // UFCS
             if (next_token()->type == TOK_IDENTIFIER && forward(1)->type == TOK_OPEN_PARENTHESIS &&
@@ -759,8 +742,8 @@ void parse_prim_expr(primary_expression_t* value)
             {
                 primary_expression_t* func_name_expr = danpa_alloc(sizeof(primary_expression_t));
                 func_name_expr->type = IDENT;
-                func_name_expr->loc = next_token()->location; func_name_expr->length = next_token()->length;
-                func_name_expr->ident.name = expect(TOK_IDENTIFIER);
+                func_name_expr->loc = *token_loc(next_token()); func_name_expr->length = next_token()->length;
+                func_name_expr->ident.name = retain_token(expect(TOK_IDENTIFIER));
                 func_name_expr->ident.flags = 0;
 
                 value->type = FUNCTION_CALL;
@@ -784,7 +767,7 @@ void parse_prim_expr(primary_expression_t* value)
             }
             else
             {
-                token_t* field = expect(TOK_IDENTIFIER);
+                token_t* field = retain_token(expect(TOK_IDENTIFIER));
 
                 value->type = STRUCT_ACCESS;
                 value->struct_access.struct_expr = expr_within;
@@ -796,7 +779,7 @@ void parse_prim_expr(primary_expression_t* value)
         {
             primary_expression_t* expr_within = (primary_expression_t*)danpa_alloc(sizeof(primary_expression_t));
             *expr_within = *value;
-            expr_within->length = last_token->location.ptr - first_tok->location.ptr;
+            expr_within->length = token_loc(last_token)->ptr - token_loc(first_tok)->ptr;
 
             value->type = FUNCTION_CALL;
             value->func_call.call_expr = expr_within;
@@ -807,14 +790,14 @@ void parse_prim_expr(primary_expression_t* value)
             break;
     }
 
-    value->length = (next_token()->location.ptr) - first_tok->location.ptr;
+    value->length = (token_loc(next_token())->ptr) - token_loc(first_tok)->ptr;
 }
 
 void parse_return_statement(return_statement_t* ret_statement)
 {
     expression_t expr;
 
-    ret_statement->return_token = expect(KEYWORD_RETURN);
+    ret_statement->return_token = retain_token(expect(KEYWORD_RETURN));
     if (accept(TOK_SEMICOLON))
     {
         ret_statement->empty_return = 1;
@@ -886,14 +869,14 @@ void parse_loop_ctrl_statement(loop_ctrl_statement_t* loop_ctrl_statement)
     token_t* tok;
     if ((tok = accept(KEYWORD_BREAK)))
     {
-        loop_ctrl_statement->tok = tok;
+        loop_ctrl_statement->tok = retain_token(tok);
         loop_ctrl_statement->type = LOOP_BREAK;
     }
     else
     {
         tok = expect(KEYWORD_CONTINUE);
 
-        loop_ctrl_statement->tok = tok;
+        loop_ctrl_statement->tok = retain_token(tok);
         loop_ctrl_statement->type = LOOP_CONTINUE;
     }
 
@@ -926,6 +909,7 @@ void parse_for_statement(for_statement_t* for_statement)
 
 void parse_foreach_statement(foreach_statement_t* foreach_statement)
 {
+    local_declaration_count += 2; // loop variable and counter
     expect(KEYWORD_FOREACH);
     if (next_token()->type == TOK_IDENTIFIER && strcmp(next_token()->data.str, "ref") == 0)
     {
@@ -946,7 +930,7 @@ void parse_foreach_statement(foreach_statement_t* foreach_statement)
     else
         foreach_statement->loop_var_type = NULL;
 
-    foreach_statement->loop_ident.name = expect(TOK_IDENTIFIER);
+    foreach_statement->loop_ident.name = retain_token(expect(TOK_IDENTIFIER));
     foreach_statement->loop_ident.flags = 0;
     expect_op(OP_IN);
 
@@ -963,10 +947,11 @@ void parse_typedef_declaration(typedef_declaration_t* decl)
 {
     expect(KEYWORD_TYPEDEF);
     parse_type(&decl->type);
-    decl->name = expect(TOK_IDENTIFIER);
+    decl->name = retain_token(expect(TOK_IDENTIFIER));
 
-    if (get_type(decl->name->data.str).base_type != INVALID_TYPE)
-        error(decl->name->location, 1, "typename '%s' is already taken\n", decl->name->data.str);
+    // shadowing the types of the enclosing scopes is allowed
+    if (type_in_current_scope(decl->name->data.str))
+        error(*token_loc(decl->name), 1, "typename '%s' is already taken\n", decl->name->data.str);
 
     add_typedef(decl->name->data.str, decl->type);
 
@@ -976,7 +961,7 @@ void parse_typedef_declaration(typedef_declaration_t* decl)
 void parse_assignment_rhs(assignment_t* assignment)
 {
     token_t* tok = consume_token();
-    assignment->eq_token = tok;
+    assignment->eq_token = retain_token(tok);
     assignment->expr = (expression_t*)danpa_alloc(sizeof(expression_t));
     parse_expr(assignment->expr, 0);
     if (tok->type == TOK_ASSIGNMENT_OP)
@@ -1019,7 +1004,7 @@ void parse_assignment_rhs(assignment_t* assignment)
                 binop->op->data.op = OP_CAT;
                 break;
             default:
-                error(tok->location, tok->length, "expected assignment operator\n");
+                error(*token_loc(tok), tok->length, "expected assignment operator\n");
 
         }
     }
@@ -1035,7 +1020,7 @@ void parse_assignment(assignment_t* assignment)
 void parse_variable_declaration(variable_declaration_t* decl)
 {
     parse_variable_type(&decl->type);
-    decl->name = expect(TOK_IDENTIFIER);
+    decl->name = retain_token(expect(TOK_IDENTIFIER));
     token_t* tok = next_token();
     if (tok->type == TOK_ASSIGNMENT_OP)
     {
@@ -1043,11 +1028,11 @@ void parse_variable_declaration(variable_declaration_t* decl)
         assigment->var.type = IDENT;
         assigment->var.ident.name = decl->name;
         assigment->var.ident.flags = 0;
-        assigment->var.loc = tok->location;
+        assigment->var.loc = *token_loc(tok);
         assigment->var.length = tok->length;
         parse_assignment_rhs(assigment);
 
-        assigment->eq_token = tok;
+        assigment->eq_token = retain_token(tok);
         assigment->discard_result = 1;
 
         decl->init_assignment = assigment;
@@ -1064,7 +1049,7 @@ void parse_struct_declaration(struct_declaration_t* decl)
     DYNARRAY_INIT(decl->field_decls, 16);
 
     expect(KEYWORD_STRUCT);
-    decl->structure.name = expect(TOK_IDENTIFIER);
+    decl->structure.name = retain_token(expect(TOK_IDENTIFIER));
     expect(TOK_OPEN_BRACE);
 
     type_t invalid = mk_type(INVALID_TYPE);
@@ -1075,7 +1060,7 @@ void parse_struct_declaration(struct_declaration_t* decl)
         if (is_struct(&search) && get_struct(&search)->incomplete)
             ;
         else
-            error(decl->structure.name->location, decl->structure.name->length, "type '%s' already exists\n", decl->structure.name->data.str);
+            error(*token_loc(decl->structure.name), decl->structure.name->length, "type '%s' already exists\n", decl->structure.name->data.str);
     }
     type_t struct_type = forward_declare_structure(decl->structure.name->data.str);
 
@@ -1086,8 +1071,7 @@ void parse_struct_declaration(struct_declaration_t* decl)
         DYNARRAY_ADD(decl->field_decls, field_decl);
     }
 
-    DYNARRAY_INIT(decl->structure.fields, decl->field_decls.size);
-    DYNARRAY_RESIZE(decl->structure.fields, decl->field_decls.size);
+    DYNARRAY_INIT_EXACT(decl->structure.fields, decl->field_decls.size);
     unsigned byte_offset = 0;
     for (int i = 0; i < decl->field_decls.size; ++i)
     {
@@ -1102,7 +1086,7 @@ void parse_struct_declaration(struct_declaration_t* decl)
 
     if (!accept(TOK_SEMICOLON))
     {
-        error(decl->structure.name->location, decl->structure.name->length, "expected a ';' at the end of the struct declaration");
+        error(*token_loc(decl->structure.name), decl->structure.name->length, "expected a ';' at the end of the struct declaration");
     }
 }
 
@@ -1112,17 +1096,23 @@ void parse_declaration(declaration_t* decl)
     {
         decl->type = VARIABLE_DECLARATION;
         parse_variable_declaration(&decl->var);
+        ++local_declaration_count;
     }
     else if (next_token()->type == KEYWORD_TYPEDEF)
     {
         decl->type = TYPEDEF_DECLARATION;
         parse_typedef_declaration(&decl->typedef_decl);
     }
-    else
+    else if (next_token()->type == KEYWORD_STRUCT)
     {
         decl->type = STRUCT_DECLARATION;
         parse_struct_declaration(&decl->struct_decl);
     }
+    else // parse_type() reports the invalid type names
+    {
+        decl->type = VARIABLE_DECLARATION;
+        parse_variable_declaration(&decl->var);
+    }
 }
 
 void parse_statement(statement_t* statement)
@@ -1193,14 +1183,16 @@ void parse_statement(statement_t* statement)
     {
         consume_token();
 
-        DYNARRAY_INIT(statement->compound.statement_list, 8);
+        DYNARRAY_INIT(statement->compound.statement_list, estimate_block_size());
 
+        types_enter_scope();
         while (!accept(TOK_CLOSE_BRACE))
         {
             statement_t st;
             parse_statement(&st);
             DYNARRAY_ADD(statement->compound.statement_list, st);
         }
+        types_exit_scope();
 
         statement->type = COMPOUND_STATEMENT;
     }
@@ -1221,11 +1213,10 @@ void parse_statement(statement_t* statement)
 void parse_function(function_t* func)
 {
     DYNARRAY_INIT(func->args, 8);
-    DYNARRAY_INIT(func->statement_list, 128);
-    DYNARRAY_INIT(func->signature.parameter_types, 8);
+    SMALL_DYNARRAY_INIT(func->signature.parameter_types);
 
     parse_type(&func->signature.ret_type);
-    token_t* name = expect(TOK_IDENTIFIER);
+    token_t* name = retain_token(expect(TOK_IDENTIFIER));
     if (strcmp(name->data.str, "operator") == 0)
     {
         token_t* op = expect(TOK_OPERATOR);
@@ -1239,16 +1230,16 @@ void parse_function(function_t* func)
     {
         parameter_t param;
         parse_variable_type(&param.type);
-        param.name = expect(TOK_IDENTIFIER);
+        param.name = retain_token(expect(TOK_IDENTIFIER));
         DYNARRAY_ADD(func->args, param);
-        DYNARRAY_ADD(func->signature.parameter_types, param.type);
+        SMALL_DYNARRAY_ADD(func->signature.parameter_types, param.type);
 
         while (accept(TOK_COMMA))
         {
             parse_variable_type(&param.type);
-            param.name = expect(TOK_IDENTIFIER);
+            param.name = retain_token(expect(TOK_IDENTIFIER));
             DYNARRAY_ADD(func->args, param);
-            DYNARRAY_ADD(func->signature.parameter_types, param.type);
+            SMALL_DYNARRAY_ADD(func->signature.parameter_types, param.type);
         }
     }
     expect(TOK_CLOSE_PARENTHESIS);
@@ -1256,35 +1247,85 @@ void parse_function(function_t* func)
 
     func->name = name;
 
+    DYNARRAY_INIT(func->statement_list, estimate_block_size());
+    local_declaration_count = 0;
+
+    types_enter_scope();
     while (next_token()->type != TOK_CLOSE_BRACE)
     {
         statement_t statement;
         parse_statement(&statement);
         DYNARRAY_ADD(func->statement_list, statement);
     }
+    types_exit_scope();
+
+    func->local_declaration_count = local_declaration_count;
 
     expect(TOK_CLOSE_BRACE);
 }
 
-int maybe_func_decl()
+// returns the lookahead offset of the token following the one which closes the bracket or parenthesis at offset 'n'
+static int skip_enclosed_tokens(int n)
 {
-    REWIND_BEGIN(maybe_func);
+    const token_type_t open = forward(n)->type;
+    const token_type_t close = open == TOK_OPEN_BRACKET ? TOK_CLOSE_BRACKET : TOK_CLOSE_PARENTHESIS;
+    int depth = 0;
+    for (;; ++n)
+    {
+        const token_type_t type = forward(n)->type;
+        if (type == TOKEN_EOF)
+            return n;
+        if (type == open)
+            ++depth;
+        else if (type == close && --depth == 0)
+            return n + 1;
+    }
+}
 
-    type_t type;
-    parse_type(&type);
+// returns the lookahead offset of the token following the type starting at offset 'n', or -1 if no type starts there.
+// only the tokens parse_type() would read are skipped, the base type isn't looked up : parse_type() reports the invalid ones
+static int skip_type_tokens(int n)
+{
+    if (forward(n)->type != TOK_IDENTIFIER)
+        return -1;
+    ++n;
 
-    expect(TOK_IDENTIFIER);
-    accept(TOK_OPERATOR); // operator overloads
-    expect(TOK_OPEN_PARENTHESIS);
+    // pointer, optional and array declarators
+    for (;;)
+    {
+        const token_t* tok = forward(n);
+        if ((tok->type == TOK_OPERATOR && tok->data.op == OP_MUL) || tok->type == TOK_QUESTION)
+            ++n;
+        else if (tok->type == TOK_OPEN_BRACKET)
+            n = skip_enclosed_tokens(n);
+        else
+            break;
+    }
+    // function type parameters
+    if (forward(n)->type == TOK_OPEN_PARENTHESIS)
+        n = skip_enclosed_tokens(n);
+
+    return n;
+}
 
-    REWIND_END(maybe_func);
+// a function definition starts with 'type name (', or 'type operator<op> (' for operator overloads
+static int starts_function_definition()
+{
+    int n = skip_type_tokens(0);
+    if (n < 0 || forward(n)->type != TOK_IDENTIFIER)
+        return 0;
+    ++n;
+    if (forward(n)->type == TOK_OPERATOR) // operator overloads
+        ++n;
 
-    return REWIND_FAILED(maybe_func) == 0;
+    return forward(n)->type == TOK_OPEN_PARENTHESIS;
 }
 
 void parse_program(program_t* program)
 {
     current_program = program;
+    token_pos = 0;
+    prev_token_val = NULL;
 
     DYNARRAY_INIT(program->function_list, 16);
     DYNARRAY_INIT(program->global_declarations, 32);
@@ -1292,9 +1333,11 @@ void parse_program(program_t* program)
 
     while (next_token()->type != TOKEN_EOF)
     {
+        // the parsed declarations only hold copies of their tokens : only the previous token is still referenced
+        release_tokens_before(token_pos - 1);
+
         // function declaration
-        //if (token_is_type(next_token()) && forward(1)->type == TOK_IDENTIFIER && forward(2)->type == TOK_OPEN_PARENTHESIS)
-        if (maybe_func_decl())
+        if (starts_function_definition())
         {
             function_t func;
             parse_function(&func);
@@ -1311,13 +1354,52 @@ void parse_program(program_t* program)
     }
 }
 
+void benchmark_parser(const char* source, size_t source_size, const char* filename)
+{
+    const alloc_region_t previous_region = set_alloc_region(REGION_LEXER);
+
+    const int file_id = add_source_file(filename, source, source_size);
+    int passes = 0, token_count = 0;
+    const uint32_t first_location = location_count;
+    const clock_t start = clock();
+    clock_t elapsed;
+    do
+    {
+        // forget the macros, types and overloads defined by the previous pass
+        init_pp();
+        set_alloc_region(REGION_LEXER);
+        init_token_stream(file_id);
+
+        set_alloc_region(REGION_AST);
+        types_init();
+        clear_overloads();
+
+        program_t prog;
+        parse_program(&prog);
+
+        token_count = token_pos;
+        ++passes;
+        release_region(REGION_LEXER);
+        release_region(REGION_AST);
+        truncate_locations(first_location);
+
+        elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC);
+
+    const double seconds = (double)elapsed / CLOCKS_PER_SEC;
+    printf("parser : %d tokens, %d passes over %zu bytes in %.3fs : %.2f MB/s, %.0f tokens/s\n",
+           token_count, passes, source_size, seconds, source_size*passes/seconds/1e6, token_count*passes/seconds);
+
+    set_alloc_region(previous_region);
+}
+
 void parse_non_ternary_expr(expression_t* expr, int expr_precedence)
 {
     expression_t* lhs = (expression_t*)danpa_alloc(sizeof(expression_t));
     lhs->flags = 0;
 
     token_t* first_tok = next_token();
-    lhs->loc = first_tok->location;
+    lhs->loc = *token_loc(first_tok);
 
     primary_expression_t val;
     parse_prim_expr(&val);
@@ -1339,7 +1421,7 @@ void parse_non_ternary_expr(expression_t* expr, int expr_precedence)
         {
             consume_token();
 
-            lhs->length = (prev_token()->location.ptr + prev_token()->length) - first_tok->location.ptr;
+            lhs->length = (token_loc(prev_token())->ptr + prev_token()->length) - token_loc(first_tok)->ptr;
 
             expression_t rhs;
             parse_non_ternary_expr(&rhs, operators[op->data.op].precedence + 1);
@@ -1352,7 +1434,7 @@ void parse_non_ternary_expr(expression_t* expr, int expr_precedence)
             new_node->binop = (binop_t*)danpa_alloc(sizeof(binop_t));
             new_node->binop->left = *lhs;
             new_node->binop->right = rhs;
-            new_node->binop->op = op;
+            new_node->binop->op = retain_token(op);
 
             lhs = new_node;
 
@@ -1362,7 +1444,7 @@ void parse_non_ternary_expr(expression_t* expr, int expr_precedence)
 
     *expr = *lhs;
 
-    expr->length = (prev_token()->location.ptr + prev_token()->length) - first_tok->location.ptr;
+    expr->length = (token_loc(prev_token())->ptr + prev_token()->length) - token_loc(first_tok)->ptr;
 }
 
 void parse_expr(expression_t* expr, int expr_precedence)
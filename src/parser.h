@@ -27,10 +27,9 @@ SOFTWARE.
 
 #include "ast_nodes.h"
 
-typedef struct token_t token_t;
-
-void set_parser_token_list(token_t* token_list);
-
 void parse_program(program_t* program);
 
+// parses the source repeatedly for about a second, and prints the parser throughput (lexing and preprocessing included)
+void benchmark_parser(const char* source, size_t source_size, const char* filename);
+
 #endif // PARSER_H
@@ -0,0 +1,530 @@
+/*
+pch.c
+
+Copyright (c) 26 Yann BOUCHER (yann)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "pch.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hash_table.h"
+#include "preprocessor.h"
+#include "file_read.h"
+#include "alloc.h"
+
+#define ALLOC_TAG ALLOC_TAG_PREPROCESSOR
+
+#define PCH_MAX_PATH 4096
+#define PCH_NO_STRING UINT32_MAX
+
+// The file is a header followed by arrays of fixed-size records, in the order of the header's counts, then by the strings.
+// Records refer to the strings by index : each string is stored null-terminated, at the offset given by the offset array.
+// Tokens refer to their file by index, and to their spelling by its offset in that file.
+
+typedef struct pch_header_t
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t file_count;
+    uint32_t token_count; // the header's tokens come first, followed by the macros' arguments and bodies
+    uint32_t stream_token_count;
+    uint32_t macro_count;
+    uint32_t tested_macro_count;
+    uint32_t string_count;
+    uint32_t strings_size;
+    uint32_t padding;
+} pch_header_t;
+
+typedef struct pch_file_t
+{
+    int64_t mtime; // nanoseconds
+    int64_t size;
+    uint32_t path;
+    uint32_t name;
+    uint32_t guard_macro; // PCH_NO_STRING if there is none
+    uint32_t pragma_once;
+} pch_file_t;
+
+typedef struct pch_token_t
+{
+    uint32_t type;
+    int32_t length;
+    uint32_t data; // string index for identifiers and string literals, the raw value otherwise
+    uint32_t file;
+    uint32_t offset;
+    uint32_t leading_space;
+} pch_token_t;
+
+typedef struct pch_macro_t
+{
+    uint32_t ident; // token index
+    uint32_t function_like;
+    uint32_t variadic;
+    uint32_t first_arg;
+    uint32_t arg_count;
+    uint32_t first_body_token;
+    uint32_t body_token_count;
+} pch_macro_t;
+
+typedef struct pch_sections_t
+{
+    const pch_header_t* header;
+    const pch_file_t* files;
+    const pch_token_t* tokens;
+    const pch_macro_t* macros;
+    const uint32_t* tested_macros;
+    const uint32_t* string_offsets;
+    const char* strings;
+} pch_sections_t;
+
+static const uint8_t pch_magic[4] = {'D', 'P', 'H', '\0'};
+
+const char* pch_path(const char* header_path)
+{
+    size_t length = strlen(header_path);
+    if (length > 4 && strcmp(header_path + length - 4, ".dps") == 0)
+        length -= 4;
+
+    char* path = danpa_alloc(length + 5);
+    memcpy(path, header_path, length);
+    strcpy(path + length, ".dph");
+    return path;
+}
+
+typedef struct pch_writer_t
+{
+    hash_table_t string_indices; // interned string -> index
+    DYNARRAY(uint32_t) string_offsets;
+    DYNARRAY(char) strings;
+    DYNARRAY(pch_token_t) tokens;
+    const precompiled_header_t* pch;
+} pch_writer_t;
+
+static uint32_t add_string(pch_writer_t* writer, const char* interned)
+{
+    if (!interned)
+        return PCH_NO_STRING;
+
+    hash_value_t* val = hash_table_get_interned(&writer->string_indices, interned);
+    if (val)
+        return val->idx;
+
+    const int index = writer->string_offsets.size;
+    DYNARRAY_ADD(writer->string_offsets, writer->strings.size);
+    const int length = get_interned(interned)->length;
+    for (int i = 0; i <= length; ++i) // with the null terminator
+        DYNARRAY_ADD(writer->strings, interned[i]);
+
+    hash_table_insert_interned(&writer->string_indices, interned, (hash_value_t){.idx = index});
+    return index;
+}
+
+static void add_token(pch_writer_t* writer, const token_t* tok)
+{
+    pch_token_t record;
+    record.type = tok->type;
+    record.length = tok->length;
+    record.leading_space = tok->leading_space;
+    if (tok->type == TOK_IDENTIFIER)
+        record.data = add_string(writer, tok->data.str);
+    else if (tok->type == TOK_STRING_LITERAL)
+        record.data = add_string(writer, string_literal_str(tok));
+    else
+        memcpy(&record.data, &tok->data.integer, sizeof(record.data));
+
+    const source_location_t* loc = token_loc(tok);
+    record.file = 0;
+    for (int i = 0; i < writer->pch->files.size; ++i)
+        if (writer->pch->files.ptr[i].file_id == loc->file_id)
+            record.file = i;
+
+    const source_file_t* file = get_source_file(writer->pch->files.ptr[record.file].file_id);
+    record.offset = 0;
+    if (loc->ptr >= file->base && loc->ptr <= file->base + file->size)
+        record.offset = loc->ptr - file->base;
+
+    DYNARRAY_ADD(writer->tokens, record);
+}
+
+int write_pch(const char* path, const precompiled_header_t* pch)
+{
+    pch_writer_t writer;
+    writer.string_indices = mk_hash_table(256);
+    DYNARRAY_INIT(writer.string_offsets, 256);
+    DYNARRAY_INIT(writer.strings, 4096);
+    DYNARRAY_INIT(writer.tokens, pch->tokens.size + 256);
+    writer.pch = pch;
+
+    DYNARRAY(pch_file_t) files;
+    DYNARRAY_INIT(files, pch->files.size);
+    for (int i = 0; i < pch->files.size; ++i)
+    {
+        const pch_file_info_t* info = &pch->files.ptr[i];
+        pch_file_t record;
+        record.mtime = info->mtime;
+        record.size = info->size;
+        record.path = add_string(&writer, info->path);
+        record.name = add_string(&writer, info->name);
+        record.guard_macro = add_string(&writer, info->guard_macro);
+        record.pragma_once = info->pragma_once;
+        DYNARRAY_ADD(files, record);
+    }
+
+    for (int i = 0; i < pch->tokens.size; ++i)
+        add_token(&writer, &pch->tokens.ptr[i]);
+
+    DYNARRAY(pch_macro_t) macros;
+    DYNARRAY_INIT(macros, pch->macros.size);
+    for (int i = 0; i < pch->macros.size; ++i)
+    {
+        const macro_def_t* def = pch->macros.ptr[i];
+        pch_macro_t record;
+        record.function_like = def->function_like;
+        record.variadic = def->variadic;
+
+        record.ident = writer.tokens.size;
+        add_token(&writer, def->macro_ident);
+
+        record.first_arg = writer.tokens.size;
+        record.arg_count = def->args.size;
+        for (int j = 0; j < def->args.size; ++j)
+            add_token(&writer, &SMALL_DYNARRAY_DATA(def->args)[j]);
+
+        record.first_body_token = writer.tokens.size;
+        record.body_token_count = def->macro_tokens.size;
+        for (int j = 0; j < def->macro_tokens.size; ++j)
+            add_token(&writer, &def->macro_tokens.ptr[j]);
+
+        DYNARRAY_ADD(macros, record);
+    }
+
+    DYNARRAY(uint32_t) tested_macros;
+    DYNARRAY_INIT(tested_macros, pch->tested_macros.size);
+    for (int i = 0; i < pch->tested_macros.size; ++i)
+        DYNARRAY_ADD(tested_macros, add_string(&writer, pch->tested_macros.ptr[i]));
+
+    pch_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, pch_magic, sizeof(header.magic));
+    header.version = PCH_VERSION;
+    header.file_count = files.size;
+    header.token_count = writer.tokens.size;
+    header.stream_token_count = pch->tokens.size;
+    header.macro_count = macros.size;
+    header.tested_macro_count = tested_macros.size;
+    header.string_count = writer.string_offsets.size;
+    header.strings_size = writer.strings.size;
+
+    FILE* output = fopen(path, "wb");
+    if (!output)
+        return 0;
+
+    int success = fwrite(&header, sizeof(header), 1, output) == 1;
+    success &= fwrite(files.ptr, sizeof(pch_file_t), files.size, output) == (size_t)files.size;
+    success &= fwrite(writer.tokens.ptr, sizeof(pch_token_t), writer.tokens.size, output) == (size_t)writer.tokens.size;
+    success &= fwrite(macros.ptr, sizeof(pch_macro_t), macros.size, output) == (size_t)macros.size;
+    success &= fwrite(tested_macros.ptr, sizeof(uint32_t), tested_macros.size, output) == (size_t)tested_macros.size;
+    success &= fwrite(writer.string_offsets.ptr, sizeof(uint32_t), writer.string_offsets.size, output) == (size_t)writer.string_offsets.size;
+    success &= fwrite(writer.strings.ptr, 1, writer.strings.size, output) == (size_t)writer.strings.size;
+    success &= fclose(output) == 0;
+
+    if (!success)
+        remove(path);
+
+    return success;
+}
+
+// the header's counts have been checked against the file size
+static pch_sections_t get_sections(const void* data)
+{
+    pch_sections_t sections;
+    const uint8_t* ptr = data;
+
+    sections.header = (const pch_header_t*)ptr;            ptr += sizeof(pch_header_t);
+    sections.files = (const pch_file_t*)ptr;               ptr += sections.header->file_count * sizeof(pch_file_t);
+    sections.tokens = (const pch_token_t*)ptr;             ptr += sections.header->token_count * sizeof(pch_token_t);
+    sections.macros = (const pch_macro_t*)ptr;             ptr += sections.header->macro_count * sizeof(pch_macro_t);
+    sections.tested_macros = (const uint32_t*)ptr;         ptr += sections.header->tested_macro_count * sizeof(uint32_t);
+    sections.string_offsets = (const uint32_t*)ptr;        ptr += sections.header->string_count * sizeof(uint32_t);
+    sections.strings = (const char*)ptr;
+
+    return sections;
+}
+
+static const char* get_string(const pch_sections_t* sections, uint32_t index)
+{
+    if (index == PCH_NO_STRING)
+        return NULL;
+    return sections->strings + sections->string_offsets[index];
+}
+
+static int check_string(const pch_sections_t* sections, uint32_t index, int optional)
+{
+    if (index == PCH_NO_STRING)
+        return optional;
+    return index < sections->header->string_count;
+}
+
+static int check_sections(const pch_sections_t* sections)
+{
+    const pch_header_t* header = sections->header;
+
+    // the strings have to be null-terminated inside of the table
+    if (header->strings_size == 0 || sections->strings[header->strings_size - 1] != '\0')
+        return header->string_count == 0;
+    for (uint32_t i = 0; i < header->string_count; ++i)
+        if (sections->string_offsets[i] >= header->strings_size)
+            return 0;
+
+    if (header->file_count == 0 || header->stream_token_count > header->token_count)
+        return 0;
+    for (uint32_t i = 0; i < header->file_count; ++i)
+        if (!check_string(sections, sections->files[i].path, 0) || !check_string(sections, sections->files[i].name, 0) ||
+            !check_string(sections, sections->files[i].guard_macro, 1))
+            return 0;
+
+    for (uint32_t i = 0; i < header->token_count; ++i)
+    {
+        const pch_token_t* tok = &sections->tokens[i];
+        if (tok->type >= TOKEN_ENUM_END || tok->file >= header->file_count)
+            return 0;
+        if ((tok->type == TOK_IDENTIFIER || tok->type == TOK_STRING_LITERAL) && !check_string(sections, tok->data, 0))
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < header->macro_count; ++i)
+    {
+        const pch_macro_t* macro = &sections->macros[i];
+        if (macro->ident >= header->token_count || sections->tokens[macro->ident].type != TOK_IDENTIFIER ||
+            (uint64_t)macro->first_arg + macro->arg_count > header->token_count ||
+            (uint64_t)macro->first_body_token + macro->body_token_count > header->token_count)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < header->tested_macro_count; ++i)
+        if (!check_string(sections, sections->tested_macros[i], 0))
+            return 0;
+
+    return 1;
+}
+
+const void* open_pch(const char* path)
+{
+    size_t size;
+    const uint8_t* data = read_file(path, &size);
+    if (!data || size < sizeof(pch_header_t))
+        return NULL;
+
+    const pch_header_t* header = (const pch_header_t*)data;
+    if (memcmp(header->magic, pch_magic, sizeof(pch_magic)) != 0 || header->version != PCH_VERSION)
+        return NULL;
+
+    const uint64_t expected_size = sizeof(pch_header_t)
+            + (uint64_t)header->file_count * sizeof(pch_file_t)
+            + (uint64_t)header->token_count * sizeof(pch_token_t)
+            + (uint64_t)header->macro_count * sizeof(pch_macro_t)
+            + (uint64_t)header->tested_macro_count * sizeof(uint32_t)
+            + (uint64_t)header->string_count * sizeof(uint32_t)
+            + header->strings_size;
+    if (expected_size != size)
+        return NULL;
+
+    const pch_sections_t sections = get_sections(data);
+    if (!check_sections(&sections))
+        return NULL;
+
+    // up to date if none of the files changed since
+    for (uint32_t i = 0; i < header->file_count; ++i)
+    {
+        char file_path[PCH_MAX_PATH];
+        int64_t mtime, size;
+        if (!file_identity(get_string(&sections, sections.files[i].path), file_path, sizeof(file_path), &mtime, &size) ||
+            strcmp(file_path, get_string(&sections, sections.files[i].path)) != 0 ||
+            mtime != sections.files[i].mtime || size != sections.files[i].size)
+            return NULL;
+    }
+
+    return data;
+}
+
+const char* pch_guard_macro(const void* data)
+{
+    const pch_sections_t sections = get_sections(data);
+    const char* guard = get_string(&sections, sections.files[0].guard_macro);
+    return guard ? intern_string(guard, strlen(guard)) : NULL;
+}
+
+int pch_macros_undefined(const void* data, int (*is_defined)(const char* name))
+{
+    const pch_sections_t sections = get_sections(data);
+
+    for (uint32_t i = 0; i < sections.header->tested_macro_count; ++i)
+    {
+        const char* name = get_string(&sections, sections.tested_macros[i]);
+        if (is_defined(intern_string(name, strlen(name))))
+            return 0;
+    }
+    for (uint32_t i = 0; i < sections.header->macro_count; ++i)
+    {
+        const char* name = get_string(&sections, sections.tokens[sections.macros[i].ident].data);
+        if (is_defined(intern_string(name, strlen(name))))
+            return 0;
+    }
+
+    return 1;
+}
+
+int pch_includes_not_skipped(const void* data, int (*is_skipped)(const char* path, int pragma_once))
+{
+    const pch_sections_t sections = get_sections(data);
+
+    // the header itself comes first
+    for (uint32_t i = 1; i < sections.header->file_count; ++i)
+    {
+        const char* path = get_string(&sections, sections.files[i].path);
+        if (is_skipped(intern_string(path, strlen(path)), sections.files[i].pragma_once))
+            return 0;
+    }
+
+    return 1;
+}
+
+typedef struct pch_loader_t
+{
+    pch_sections_t sections;
+    const char** interned; // by string index, interned on first use
+    precompiled_header_t* pch;
+    token_t* include_tok;
+} pch_loader_t;
+
+static const char* loaded_string(pch_loader_t* loader, uint32_t index)
+{
+    if (!loader->interned[index])
+    {
+        const char* str = get_string(&loader->sections, index);
+        loader->interned[index] = intern_string(str, strlen(str));
+    }
+    return loader->interned[index];
+}
+
+static token_t load_token(pch_loader_t* loader, uint32_t index, int in_stream)
+{
+    const pch_token_t* record = &loader->sections.tokens[index];
+
+    token_t tok;
+    tok.type = record->type;
+    tok.length = record->length;
+    tok.leading_space = record->leading_space;
+    tok.hide_set = 0;
+    if (record->type == TOK_IDENTIFIER)
+        tok.data.str = loaded_string(loader, record->data);
+    else if (record->type == TOK_STRING_LITERAL)
+    {
+        // the literal's spelling, as it was in the source
+        tok.data.slice.ptr = get_string(&loader->sections, record->data);
+        tok.data.slice.length = strlen(tok.data.slice.ptr);
+    }
+    else
+        memcpy(&tok.data.integer, &record->data, sizeof(record->data));
+
+    const pch_file_info_t* file = &loader->pch->files.ptr[record->file];
+    const source_file_t* source = get_source_file(file->file_id);
+    source_location_t loc;
+    loc.ptr = source->base + (record->offset <= source->size ? record->offset : 0);
+    loc.file_id = file->file_id;
+    // the header's own tokens come from its inclusion, the macros' tokens are marked when they are expanded
+    loc.macro_invok_token = in_stream ? loader->include_tok : NULL;
+    loc.macro_invok_type = INCLUDED_TOKEN;
+    tok.loc_id = add_location(&loc);
+
+    return tok;
+}
+
+int load_pch(const void* data, int header_file_id, token_t* include_tok, precompiled_header_t* pch)
+{
+    pch_loader_t loader;
+    loader.sections = get_sections(data);
+    loader.pch = pch;
+    loader.include_tok = include_tok;
+    const pch_header_t* header = loader.sections.header;
+
+    loader.interned = danpa_alloc((header->string_count + 1) * sizeof(const char*));
+    memset(loader.interned, 0, (header->string_count + 1) * sizeof(const char*));
+
+    DYNARRAY_INIT(pch->files, header->file_count);
+    for (uint32_t i = 0; i < header->file_count; ++i)
+    {
+        const pch_file_t* record = &loader.sections.files[i];
+        pch_file_info_t info;
+        info.path = loaded_string(&loader, record->path);
+        info.name = loaded_string(&loader, record->name);
+        info.mtime = record->mtime;
+        info.size = record->size;
+        info.guard_macro = record->guard_macro == PCH_NO_STRING ? NULL : loaded_string(&loader, record->guard_macro);
+        info.pragma_once = record->pragma_once;
+        info.file_id = header_file_id;
+        if (i > 0)
+        {
+            size_t size;
+            const char* source = (const char*)read_file(info.path, &size);
+            if (!source)
+                return 0;
+            info.file_id = add_source_file(info.name, source, size);
+        }
+        DYNARRAY_ADD(pch->files, info);
+    }
+
+    DYNARRAY_INIT(pch->tokens, header->stream_token_count + 1);
+    for (uint32_t i = 0; i < header->stream_token_count; ++i)
+        DYNARRAY_ADD(pch->tokens, load_token(&loader, i, 1));
+
+    DYNARRAY_INIT(pch->macros, header->macro_count);
+    for (uint32_t i = 0; i < header->macro_count; ++i)
+    {
+        const pch_macro_t* record = &loader.sections.macros[i];
+
+        macro_def_t* def = danpa_alloc(sizeof(macro_def_t));
+        def->macro_ident = danpa_alloc_in(REGION_GLOBAL, sizeof(token_t));
+        *def->macro_ident = load_token(&loader, record->ident, 0);
+        def->function_like = record->function_like;
+        def->variadic = record->variadic;
+
+        SMALL_DYNARRAY_INIT(def->args);
+        for (uint32_t j = 0; j < record->arg_count; ++j)
+            SMALL_DYNARRAY_ADD(def->args, load_token(&loader, record->first_arg + j, 0));
+
+        DYNARRAY_INIT(def->macro_tokens, record->body_token_count + 1);
+        for (uint32_t j = 0; j < record->body_token_count; ++j)
+            DYNARRAY_ADD(def->macro_tokens, load_token(&loader, record->first_body_token + j, 0));
+        prepare_macro_body(def);
+
+        DYNARRAY_ADD(pch->macros, def);
+    }
+
+    DYNARRAY_INIT(pch->tested_macros, header->tested_macro_count);
+    for (uint32_t i = 0; i < header->tested_macro_count; ++i)
+        DYNARRAY_ADD(pch->tested_macros, loaded_string(&loader, loader.sections.tested_macros[i]));
+
+    return 1;
+}
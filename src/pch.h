@@ -0,0 +1,51 @@
+#ifndef PCH_H
+#define PCH_H
+
+#include "lexer.h"
+
+// Precompiled headers : a header preprocessed on its own is saved next to it, as a .dph file.
+// The file holds the header's tokens (before macro expansion) and the macros it defines, and is loaded by mapping it :
+// nothing is lexed again. It stands in for the header as long as the header and the files it includes are unchanged.
+
+#define PCH_VERSION 3
+
+// the strings are interned
+typedef struct pch_file_info_t
+{
+    const char* path; // canonical
+    const char* name; // as it was included, for the diagnostics
+    int64_t mtime; // nanoseconds
+    int64_t size;
+    const char* guard_macro;
+    int pragma_once;
+    int file_id;
+} pch_file_info_t;
+
+typedef struct precompiled_header_t
+{
+    DYNARRAY(pch_file_info_t) files; // the header itself comes first
+    token_list_t tokens;
+    DYNARRAY(macro_def_t*) macros;
+    // the macros tested by the header's conditions : their state was part of the preprocessing
+    DYNARRAY(const char*) tested_macros;
+} precompiled_header_t;
+
+// returns the .dph path of a header
+const char* pch_path(const char* header_path);
+// returns 0 if the file couldn't be written
+int write_pch(const char* path, const precompiled_header_t* pch);
+
+// maps the precompiled header if it is valid and up to date, returns NULL otherwise
+const void* open_pch(const char* path);
+// the guard macro of the header, NULL if it has none
+const char* pch_guard_macro(const void* data);
+// returns 1 if none of the macros the header defines or tests is defined
+int pch_macros_undefined(const void* data, int (*is_defined)(const char* name));
+// returns 1 if none of the files the header includes would be skipped by 'is_skipped', given their canonical path and
+// whether they are marked with '#pragma once'
+int pch_includes_not_skipped(const void* data, int (*is_skipped)(const char* path, int pragma_once));
+// the included files are mapped and registered, the header itself has to be registered as 'header_file_id'.
+// the header's tokens are attributed to 'include_tok'. returns 0 if one of the files couldn't be read
+int load_pch(const void* data, int header_file_id, token_t* include_tok, precompiled_header_t* pch);
+
+#endif // PCH_H
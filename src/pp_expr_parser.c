@@ -7,6 +7,8 @@
 #include "preprocessor.h"
 #include "error.h"
 
+#define ALLOC_TAG ALLOC_TAG_PREPROCESSOR
+
 typedef struct rpl_token_t
 {
     enum
@@ -93,15 +95,15 @@ int pp_evaluate_expr(const token_list_t *tokens)
                     && tokens->ptr[i+3].type == TOK_CLOSE_PARENTHESIS)
                 {
                     rpl_token.type = RPL_LITERAL;
-                    if (hash_table_get(&macro_definitions, tokens->ptr[i+2].data.str))
+                    if (hash_table_get_interned(&macro_definitions, tokens->ptr[i+2].data.str))
                         rpl_token.value = 1;
                     else
                         rpl_token.value = 0;
 
-                    i += 4;
+                    i += 3; // the loop skips the ')'
                 }
                 else
-                    error(token->location, token->length, "expected 'defined(<MACRO>)'\n");
+                    error(*token_loc(token), token->length, "expected 'defined(<MACRO>)'\n");
 
                 DYNARRAY_ADD(rpl_stack, rpl_token);
                 break;
@@ -145,11 +147,11 @@ int pp_evaluate_expr(const token_list_t *tokens)
                 }
 
                 if (op_stack.size == 0)
-                    error(token->location, token->length, "unmatched parenthesis found\n");
+                    error(*token_loc(token), token->length, "unmatched parenthesis found\n");
                 DYNARRAY_POP(op_stack); // pop the '('
                 break;
             default:
-                error(token->location, token->length, "unexpected token %s\n", tokens_str[token->type]);
+                error(*token_loc(token), token->length, "unexpected token %s\n", tokens_str[token->type]);
         }
     }
     // while there are remaining operators on the op stack
@@ -161,8 +163,8 @@ int pp_evaluate_expr(const token_list_t *tokens)
         DYNARRAY_ADD(rpl_stack, rpl_token);
     }
 
-    source_location_t loc_begin = tokens->ptr[0].location;
-    int length = tokens->ptr[tokens->size-1].location.ptr + tokens->ptr[tokens->size-1].length - tokens->ptr[0].location.ptr;
+    source_location_t loc_begin = *token_loc(&tokens->ptr[0]);
+    int length = token_loc(&tokens->ptr[tokens->size-1])->ptr + tokens->ptr[tokens->size-1].length - token_loc(&tokens->ptr[0])->ptr;
 
     return evaluate_rpl_input(&loc_begin, length, &rpl_stack);
 }
@@ -0,0 +1,135 @@
+/*
+pp_output.c
+
+Copyright (c) 26 Yann BOUCHER (yann)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "pp_output.h"
+
+#include "token_stream.h"
+#include "operators.h"
+
+// more blank lines than this are replaced by a line marker
+#define MAX_BLANK_LINES 8
+
+static struct
+{
+    FILE* output;
+    int file_id;
+    int line;
+    int at_line_start;
+    int prev_from_source;
+    const char* prev_end; // end of the last token's spelling in the source
+} out;
+
+static void write_line_marker(int file_id, int line)
+{
+    if (!out.at_line_start)
+        fputc('\n', out.output);
+    fprintf(out.output, "# %d \"%s\"\n", line, get_source_file(file_id)->filename);
+    out.file_id = file_id;
+    out.line = line;
+    out.at_line_start = 1;
+}
+
+// the expanded tokens don't keep their spelling : it is rebuilt from the token itself
+static void write_token(const token_t* tok)
+{
+    switch (tok->type)
+    {
+        case TOK_IDENTIFIER:
+            fputs(tok->data.str, out.output);
+            break;
+        case TOK_OPERATOR:
+            fputs(operators[tok->data.op].str, out.output);
+            break;
+        case TOK_INTEGER_LITERAL:
+            fprintf(out.output, "%d", tok->data.integer);
+            break;
+        case TOK_FLOAT_LITERAL:
+            fwrite(token_loc(tok)->ptr, 1, tok->length, out.output);
+            break;
+        case TOK_STRING_LITERAL:
+            fputc('"', out.output);
+            fwrite(tok->data.slice.ptr, 1, tok->data.slice.length, out.output);
+            fputc('"', out.output);
+            break;
+        default:
+            fputs(tokens_str[tok->type], out.output);
+            break;
+    }
+}
+
+void write_preprocessed(FILE* output)
+{
+    out.output = output;
+    out.file_id = -1; // the first token writes a line marker
+    out.line = 0;
+    out.at_line_start = 1;
+    out.prev_from_source = 0;
+
+    const token_t* tok;
+    for (int i = 0; (tok = stream_token(i))->type != TOKEN_EOF; ++i)
+    {
+        // the tokens of a macro's body are placed at its invocation, the arguments follow them
+        const source_location_t* loc = token_loc(tok);
+        const int from_source = !loc->macro_invok_token || loc->macro_invok_type == INCLUDED_TOKEN;
+        const source_location_t* placement = loc;
+        if (!from_source && loc->macro_invok_type == MACRO_TOKEN)
+            placement = token_loc(loc->macro_invok_token);
+
+        const char* line_start = NULL;
+        const int line = loc->macro_invok_type == MACRO_ARG_TOKEN && !from_source ? 0 : location_line(placement, &line_start);
+        // the invocations of nested expansions are in a macro body : their tokens stay where the output is
+        if (line > 0 && (from_source ? (loc->file_id != out.file_id || line != out.line)
+                                     : (placement->file_id == out.file_id && line > out.line)))
+        {
+            if (placement->file_id != out.file_id || line < out.line || line > out.line + MAX_BLANK_LINES)
+                write_line_marker(placement->file_id, line);
+            for (; out.line < line; ++out.line)
+                fputc('\n', out.output);
+            out.at_line_start = 1;
+        }
+
+        if (out.at_line_start)
+        {
+            // keep the indentation
+            if (from_source)
+                for (const char* ptr = line_start; ptr < loc->ptr && (*ptr == ' ' || *ptr == '\t'); ++ptr)
+                    fputc(*ptr, out.output);
+        }
+        // tokens that are next to each other in the source stay together
+        else if (!from_source || !out.prev_from_source || out.prev_end != loc->ptr)
+            fputc(' ', out.output);
+
+        write_token(tok);
+        out.at_line_start = 0;
+        out.prev_from_source = from_source;
+        out.prev_end = loc->ptr + tok->length;
+
+        // the parser would release them as it goes
+        release_tokens_before(i);
+    }
+
+    if (!out.at_line_start)
+        fputc('\n', out.output);
+}
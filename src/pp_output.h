@@ -0,0 +1,12 @@
+#ifndef PP_OUTPUT_H
+#define PP_OUTPUT_H
+
+#include <stdio.h>
+
+// Preprocess-only mode (-E) : the expanded tokens of the token stream are written out as they are produced,
+// with the source's line structure and '# <line> "<file>"' line markers.
+
+// the token stream has to be initialized
+void write_preprocessed(FILE* output);
+
+#endif // PP_OUTPUT_H
@@ -1,21 +1,350 @@
 #include "preprocessor.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 
 #include "lexer.h"
 #include "pp_expr_parser.h"
 #include "hash_table.h"
+#include "hash.h"
 #include "file_read.h"
 #include "error.h"
+#include "pch.h"
+#include "operators.h"
+
+#define ALLOC_TAG ALLOC_TAG_PREPROCESSOR
+
+#define MAX_INCLUDE_PATH 4096
 
 hash_table_t macro_definitions;
 
+// Included files are cached by canonical path : including a file again doesn't read it again, and the tokens of a file
+// which ran no directive are replayed instead of lexing it again.
+// Files wrapped in an include guard or marked with '#pragma once' are skipped without looking at their tokens.
+typedef struct include_entry_t
+{
+    const char* path; // canonical, interned
+    int64_t mtime;
+    const char* source;
+    size_t size;
+    int file_id;
+    const char* guard_macro; // X for a file wrapped in '#ifndef X ... #endif', NULL otherwise
+    int pragma_once;
+    int replayable; // set once the file was lexed without running any directive : its tokens don't depend on the macros
+    token_list_t tokens;
+    const void* pch; // the file's up to date precompiled header, if it has one
+} include_entry_t;
+
+static hash_table_t include_cache;
+static DYNARRAY(include_entry_t*) include_entries;
+// the number of directives run so far
+static int directive_count;
+
+// set while a precompiled header is built : existing ones aren't used, and the macros tested by conditions are recorded
+static int building_pch;
+static DYNARRAY(const char*) tested_macros;
+
+// interned, compared by address
+static const char* file_ident;
+static const char* line_ident;
+static const char* va_args_ident;
+static const char* va_count_ident;
+
+// the expansions of function-like macros, see cache_expansion()
+typedef struct expansion_cache_entry_t expansion_cache_entry_t;
+static expansion_cache_entry_t** expansion_cache;
+static int expansion_cache_count;
+static void clear_expansion_cache();
+
 void handle_if_chain(token_list_t* tokens, source_location_t* loc);
 
 void init_pp()
 {
     macro_definitions = mk_hash_table(64);
+    include_cache = mk_hash_table(16);
+    DYNARRAY_INIT(include_entries, 8);
+    directive_count = 0;
+    DYNARRAY_INIT(tested_macros, 16);
+    expansion_cache = NULL;
+    expansion_cache_count = 0;
+
+    file_ident     = intern_string("__FILE__"    , 8);
+    line_ident     = intern_string("__LINE__"    , 8);
+    va_args_ident  = intern_string("__VA_ARGS__" , 11);
+    va_count_ident = intern_string("__VA_COUNT__", 12);
+}
+
+// returns the name of the next directive of the buffer after 'ptr', NULL if there is none.
+// only looks for '#' at the start of a line, comments and string literals aren't taken into account
+static const char* next_directive(const char* source, const char* ptr, const char* end)
+{
+    for (; (ptr = memchr(ptr, '#', end - ptr)); ++ptr)
+    {
+        // the '#' has to start its line
+        const char* line_start = ptr;
+        while (line_start > source && (line_start[-1] == ' ' || line_start[-1] == '\t'))
+            --line_start;
+        if (line_start > source && line_start[-1] != '\n' && line_start[-1] != '\r')
+            continue;
+
+        const char* directive = ptr + 1;
+        while (*directive == ' ' || *directive == '\t')
+            ++directive;
+        return directive;
+    }
+
+    return NULL;
+}
+
+// looks for the '#include "file"' lines of a buffer, and hands the files to the prefetch threads.
+// lines in inactive #if branches are prefetched too, read_file() just never claims them
+void prefetch_includes(const char* source, size_t size)
+{
+    const char* end = source + size;
+    const char* directive;
+    for (const char* ptr = source; (directive = next_directive(source, ptr, end)); ptr = directive)
+    {
+        if (strncmp(directive, "include", 7) != 0)
+            continue;
+        directive += 7;
+        while (*directive == ' ' || *directive == '\t')
+            ++directive;
+        if (*directive != '"')
+            continue;
+
+        // names with escape sequences are left to the directive itself
+        const char* name = directive + 1;
+        const char* name_end = name;
+        while (*name_end != '"' && *name_end != '\\' && *name_end != '\0' && !is_newline(name_end))
+            ++name_end;
+        if (*name_end == '"')
+            prefetch_file(intern_string(name, name_end - name));
+    }
+}
+
+static const char* skip_blanks_and_comments(const char* ptr)
+{
+    const char* next;
+    while (1)
+    {
+        int on_new_line;
+        ptr = scan_blanks(ptr, 1, &on_new_line);
+        if (*ptr == '/' && (next = consume_comment(ptr)))
+            ptr = next;
+        else
+            return ptr;
+    }
+}
+
+// returns the guard macro of a file wrapped in '#ifndef X ... #endif' with nothing but comments around, NULL otherwise
+static const char* find_include_guard(const char* source, size_t size)
+{
+    const char* end = source + size;
+
+    const char* ptr = skip_blanks_and_comments(source);
+    if (*ptr != '#')
+        return NULL;
+    const char* directive = next_directive(source, ptr, end);
+    if (strncmp(directive, "ifndef", 6) != 0 || (directive[6] != ' ' && directive[6] != '\t'))
+        return NULL;
+
+    ptr = directive + 6;
+    while (*ptr == ' ' || *ptr == '\t')
+        ++ptr;
+    token_t guard;
+    if (!(ptr = match_identifier(ptr, &guard)))
+        return NULL;
+
+    // the matching '#endif' has to end the file, with no '#else' in between
+    int depth = 1;
+    while (depth > 0)
+    {
+        if (!(directive = next_directive(source, ptr, end)))
+            return NULL;
+        ptr = directive;
+
+        if (strncmp(directive, "if", 2) == 0)
+            ++depth;
+        else if (strncmp(directive, "endif", 5) == 0)
+            --depth;
+        else if (depth == 1 && (strncmp(directive, "else", 4) == 0 || strncmp(directive, "elif", 4) == 0))
+            return NULL;
+    }
+
+    ptr = skip_blanks_and_comments(scan_line_end(ptr));
+    if (ptr < end && *ptr != '\0')
+        return NULL;
+
+    return guard.data.str;
+}
+
+// creates the cache entry of 'path', or resets it if the file changed
+static include_entry_t* new_include_entry(const char* path, int64_t mtime, int64_t size)
+{
+    include_entry_t* entry;
+    hash_value_t* val = hash_table_get_interned(&include_cache, path);
+    if (val)
+        entry = val->ptr;
+    else
+    {
+        entry = danpa_alloc(sizeof(include_entry_t));
+        hash_table_insert_interned(&include_cache, path, (hash_value_t){.ptr = entry});
+        DYNARRAY_ADD(include_entries, entry);
+    }
+
+    entry->path = path;
+    entry->mtime = mtime;
+    entry->size = size;
+    entry->guard_macro = NULL;
+    entry->pragma_once = 0;
+    entry->replayable = 0;
+    entry->pch = NULL;
+
+    return entry;
+}
+
+// returns the cache entry of the file, reading it if it wasn't included before or changed since. NULL if it can't be read
+static include_entry_t* get_include_entry(const char* filename)
+{
+    char path_buffer[MAX_INCLUDE_PATH];
+    int64_t mtime, file_size;
+    if (!file_identity(filename, path_buffer, sizeof(path_buffer), &mtime, &file_size))
+        return NULL;
+    const char* path = intern_string(path_buffer, strlen(path_buffer));
+
+    hash_value_t* val = hash_table_get_interned(&include_cache, path);
+    include_entry_t* cached = val ? val->ptr : NULL;
+    if (cached && cached->mtime == mtime && (int64_t)cached->size == file_size)
+        return cached;
+
+    size_t size;
+    const char* source = (const char*)read_file(filename, &size);
+    if (!source)
+        return NULL;
+
+    include_entry_t* entry = new_include_entry(path, mtime, size);
+    entry->source = source;
+    entry->file_id = add_source_file(filename, source, size);
+
+    // a precompiled header saves scanning the file
+    if (!building_pch)
+        entry->pch = open_pch(pch_path(path));
+    if (entry->pch)
+        entry->guard_macro = pch_guard_macro(entry->pch);
+    else
+    {
+        prefetch_includes(source, size);
+        entry->guard_macro = find_include_guard(source, size);
+    }
+
+    return entry;
+}
+
+static int macro_is_defined(const char* name)
+{
+    return hash_table_get_interned(&macro_definitions, name) != NULL;
+}
+
+// a file marked with '#pragma once' which was already included
+static int include_is_skipped(const char* path, int pragma_once)
+{
+    hash_value_t* val = hash_table_get_interned(&include_cache, path);
+    return val && (((include_entry_t*)val->ptr)->pragma_once || pragma_once);
+}
+
+// returns 0 if the header has to be lexed instead
+static int include_precompiled_header(token_list_t* tokens, include_entry_t* entry, token_t* filename_tok)
+{
+    // the header was preprocessed with no macro defined, and with none of its files already included
+    if (!pch_macros_undefined(entry->pch, macro_is_defined) || !pch_includes_not_skipped(entry->pch, include_is_skipped))
+        return 0;
+
+    precompiled_header_t pch;
+    if (!load_pch(entry->pch, entry->file_id, filename_tok, &pch))
+        return 0;
+
+    for (int i = 0; i < pch.macros.size; ++i)
+        hash_table_insert_interned(&macro_definitions, pch.macros.ptr[i]->macro_ident->data.str, (hash_value_t){.macro_def = pch.macros.ptr[i]});
+    clear_expansion_cache();
+
+    // the files the header included are known to the cache, for their guards and '#pragma once'
+    entry->pragma_once = pch.files.ptr[0].pragma_once;
+    for (int i = 1; i < pch.files.size; ++i)
+    {
+        const pch_file_info_t* file = &pch.files.ptr[i];
+        hash_value_t* val = hash_table_get_interned(&include_cache, file->path);
+        include_entry_t* included = val ? val->ptr : NULL;
+        if (included && included->mtime == file->mtime && (int64_t)included->size == file->size)
+        {
+            included->pragma_once |= file->pragma_once;
+            continue;
+        }
+
+        const source_file_t* source = get_source_file(file->file_id);
+        included = new_include_entry(file->path, file->mtime, source->size);
+        included->source = source->base;
+        included->file_id = file->file_id;
+        included->guard_macro = file->guard_macro;
+        included->pragma_once = file->pragma_once;
+    }
+
+    DYNARRAY_RESERVE(*tokens, tokens->size + pch.tokens.size);
+    for (int i = 0; i < pch.tokens.size; ++i)
+        DYNARRAY_ADD(*tokens, pch.tokens.ptr[i]);
+
+    return 1;
+}
+
+static void include_file(token_list_t* tokens, include_entry_t* entry, token_t* filename_tok)
+{
+    if (entry->pragma_once)
+        return;
+    if (entry->guard_macro && hash_table_get_interned(&macro_definitions, entry->guard_macro))
+        return;
+
+    if (entry->replayable)
+    {
+        DYNARRAY_RESERVE(*tokens, tokens->size + entry->tokens.size);
+        for (int i = 0; i < entry->tokens.size; ++i)
+        {
+            token_t tok = entry->tokens.ptr[i];
+            source_location_t included_loc = *token_loc(&tok);
+            included_loc.macro_invok_token = filename_tok;
+            tok.loc_id = add_location(&included_loc);
+            DYNARRAY_ADD(*tokens, tok);
+        }
+        return;
+    }
+
+    if (entry->pch && include_precompiled_header(tokens, entry, filename_tok))
+        return;
+
+    DYNARRAY_RESERVE(*tokens, tokens->size + (int)(entry->size / BYTES_PER_TOKEN));
+
+    // add the included file's tokens
+    const int old_size = tokens->size;
+    const int old_directive_count = directive_count;
+    source_location_t include_loc;
+    include_loc.ptr = entry->source;
+    include_loc.file_id = entry->file_id;
+    include_loc.macro_invok_type = 0; include_loc.macro_invok_token = 0;
+    do_tokenization(tokens, &include_loc, STARTS_ON_NEWLINE);
+    const int new_tok_count = tokens->size - old_size;
+    for (int i = 0; i < new_tok_count; ++i)
+    {
+        // the tokens were just lexed, their locations aren't shared yet
+        source_location_t* included_loc = get_location(tokens->ptr[old_size + i].loc_id);
+        included_loc->macro_invok_token = filename_tok;
+        included_loc->macro_invok_type = INCLUDED_TOKEN;
+    }
+
+    if (directive_count == old_directive_count)
+    {
+        entry->replayable = 1;
+        DYNARRAY_INIT_EXACT(entry->tokens, new_tok_count);
+        memcpy(entry->tokens.ptr, tokens->ptr + old_size, new_tok_count*sizeof(token_t));
+    }
 }
 
 const char* handle_preprocessing_directives(token_list_t* tokens, source_location_t* loc)
@@ -23,6 +352,7 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
     if (*loc->ptr != '#')
         return NULL;
     ++loc->ptr;
+    ++directive_count;
 
     while (isspace(*loc->ptr))
         ++loc->ptr;
@@ -32,38 +362,26 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
         loc->ptr += 7;
         skip_whitespace(loc, 0);
 
-        token_t* filename_tok = danpa_alloc(sizeof(token_t));
+        // referenced by the source locations of the included tokens
+        token_t* filename_tok = danpa_alloc_in(REGION_GLOBAL, sizeof(token_t));
 
         const char* next;
         if ((next = match_string_literal(loc->ptr, filename_tok)))
         {
-            filename_tok->location = *loc; --filename_tok->location.ptr;
-            filename_tok->length = strlen(filename_tok->data.str) + 2; // quotes
+            source_location_t filename_loc = *loc; --filename_loc.ptr;
+            filename_tok->loc_id = add_location(&filename_loc);
+            filename_tok->length = filename_tok->data.slice.length + 2; // quotes
+            const char* filename = string_literal_str(filename_tok);
 
             loc->ptr = next;
 
-            const char* included_file = (const char*)read_file(filename_tok->data.str);
-            if (!included_file)
-                error(*loc, strlen(filename_tok->data.str) + 2, "could not open include file '%s'\n", filename_tok->data.str);
-
-            // add the included file's tokens
-            const int old_size = tokens->size;
-            source_location_t include_loc;
-            include_loc.line = 1;
-            include_loc.line_ptr = include_loc.ptr = included_file;
-            include_loc.filename = filename_tok->data.str;
-            include_loc.macro_invok_type = 0; include_loc.macro_invok_token = 0;
-            do_tokenization(tokens, &include_loc, STARTS_ON_NEWLINE);
-            const int new_tok_count = tokens->size - old_size;
-            for (int i = 0; i < new_tok_count; ++i)
-            {
-                tokens->ptr[tokens->size-new_tok_count + i].location.macro_invok_token = filename_tok;
-                tokens->ptr[tokens->size-new_tok_count + i].location.macro_invok_type = INCLUDED_TOKEN;
-            }
+            include_entry_t* entry = get_include_entry(filename);
+            if (!entry)
+                error(*loc, filename_tok->length, "could not open include file '%s'\n", filename);
+            include_file(tokens, entry, filename_tok);
 
             // skip until EOL
-            while (*loc->ptr && !is_newline(loc->ptr))
-                ++loc->ptr;
+            loc->ptr = scan_line_end(loc->ptr);
         }
         else
         {
@@ -75,33 +393,36 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
         loc->ptr += 6;
         skip_whitespace(loc, 0);
 
-        token_t* macro_tok = danpa_alloc(sizeof(token_t));
+        // referenced by the source locations of the expanded tokens
+        token_t* macro_tok = danpa_alloc_in(REGION_GLOBAL, sizeof(token_t));
 
         const char* next;
         if ((next = match_identifier(loc->ptr, macro_tok)))
         {
-            macro_tok->location = *loc;
+            macro_tok->loc_id = add_location(loc);
             macro_tok->length = strlen(macro_tok->data.str);
 
             loc->ptr = next;
 
             hash_value_t* hash_val;
-            if ((hash_val = hash_table_get(&macro_definitions, macro_tok->data.str)))
+            if ((hash_val = hash_table_get_interned(&macro_definitions, macro_tok->data.str)))
             {
-                token_t* tok = hash_val->macro_def.macro_ident;
+                token_t* tok = hash_val->macro_def->macro_ident;
                 error_begin();
                 error(*loc, macro_tok->length, "redefinition of macro '%s'\n", macro_tok->data.str);
-                info(tok->location, tok->length, "first defined here\n");
+                info(*token_loc(tok), tok->length, "first defined here\n");
                 error_end();
             }
 
-            macro_def_t macro_def;
-            macro_def.variadic = 0;
-            DYNARRAY_INIT(macro_def.args, 4);
+            macro_def_t* macro_def = danpa_alloc(sizeof(macro_def_t));
+            macro_def->variadic = 0;
+            macro_def->function_like = 0;
+            SMALL_DYNARRAY_INIT(macro_def->args);
 
             // arguments
             if (*loc->ptr == '(')
             {
+                macro_def->function_like = 1;
                 ++loc->ptr;
                 skip_whitespace(loc, 0);
 
@@ -110,11 +431,11 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
                     do
                     {
                         token_t ellipsis;
-                        if ((next = match_delimiter(loc->ptr, &ellipsis)) &&
+                        if ((next = match_punctuator(loc->ptr, &ellipsis)) &&
                             ellipsis.type == TOK_ELLIPSIS)
                         {
                             loc->ptr = next;
-                            macro_def.variadic = 1;
+                            macro_def->variadic = 1;
                             break;
                         }
 
@@ -123,12 +444,12 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
                         if (next == NULL)
                             error(*loc, 1, "expected macro argument\n");
 
-                        arg.location = *loc;
+                        arg.loc_id = add_location(loc);
                         arg.length = strlen(arg.data.str);
 
                         loc->ptr = next;
 
-                        DYNARRAY_ADD(macro_def.args, arg);
+                        SMALL_DYNARRAY_ADD(macro_def->args, arg);
                         skip_whitespace(loc, 0);
                         if (*loc->ptr == ',')
                         {
@@ -146,15 +467,16 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
                 ++loc->ptr;
             }
 
-            DYNARRAY_INIT(macro_def.macro_tokens, 32);
-            macro_def.macro_ident = macro_tok;
+            DYNARRAY_INIT(macro_def->macro_tokens, 32);
+            macro_def->macro_ident = macro_tok;
 
-            loc->ptr = do_tokenization(&macro_def.macro_tokens, loc, STOP_ON_NEWLINE);
+            loc->ptr = do_tokenization(&macro_def->macro_tokens, loc, STOP_ON_NEWLINE);
+            prepare_macro_body(macro_def);
 
-            hash_table_insert(&macro_definitions, macro_tok->data.str, (hash_value_t)macro_def);
+            hash_table_insert_interned(&macro_definitions, macro_tok->data.str, (hash_value_t){.macro_def = macro_def});
+            clear_expansion_cache();
             // advance to the next line
-            while (*loc->ptr && !is_newline(loc->ptr))
-                ++loc->ptr;
+            loc->ptr = scan_line_end(loc->ptr);
         }
         else
         {
@@ -181,7 +503,7 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
         if ((next = match_string_literal(loc->ptr, &msg_tok)))
         {
             loc->ptr = next;
-            error(directive_loc, loc->ptr - directive_loc.ptr, "%s\n", msg_tok.data.str);
+            error(directive_loc, loc->ptr - directive_loc.ptr, "%.*s\n", msg_tok.data.slice.length, msg_tok.data.slice.ptr);
         }
         else
             error(*loc, 1, "expected error message\n");
@@ -200,17 +522,72 @@ const char* handle_preprocessing_directives(token_list_t* tokens, source_locatio
         if ((next = match_string_literal(loc->ptr, &msg_tok)))
         {
             loc->ptr = next;
-            warn(directive_loc, loc->ptr - directive_loc.ptr, "%s\n", msg_tok.data.str);
+            warn(directive_loc, loc->ptr - directive_loc.ptr, "%.*s\n", msg_tok.data.slice.length, msg_tok.data.slice.ptr);
         }
         else
             error(*loc, 1, "expected warning message\n");
     }
+    else if (strncmp(loc->ptr, "pragma", 6) == 0)
+    {
+        loc->ptr += 6;
+        skip_whitespace(loc, 0);
+
+        if (strncmp(loc->ptr, "once", 4) == 0)
+        {
+            for (int i = 0; i < include_entries.size; ++i)
+                if (include_entries.ptr[i]->file_id == loc->file_id)
+                    include_entries.ptr[i]->pragma_once = 1;
+        }
+        else
+            warn(*loc, 1, "unknown pragma, ignored\n");
+
+        loc->ptr = scan_line_end(loc->ptr);
+    }
+    // the line markers written by -E : the diagnostics refer to the preprocessed file itself
+    else if (isdigit(*loc->ptr))
+    {
+        loc->ptr = scan_line_end(loc->ptr);
+    }
     else
         error(*loc, 1, "unknown macro directive\n");
 
     return loc->ptr;
 }
 
+void prepare_macro_body(macro_def_t* def)
+{
+    token_t* body = danpa_alloc_in(REGION_GLOBAL, (def->macro_tokens.size + 1)*sizeof(token_t));
+    memcpy(body, def->macro_tokens.ptr, def->macro_tokens.size*sizeof(token_t));
+    def->macro_tokens.ptr = body;
+    def->macro_tokens.capacity = def->macro_tokens.size + 1;
+
+    def->body_params = danpa_alloc((def->macro_tokens.size + 1)*sizeof(int));
+    def->stringifies = 0;
+    const token_t* def_args = SMALL_DYNARRAY_DATA(def->args);
+    for (int j = 0; j < def->macro_tokens.size; ++j)
+    {
+        const token_t* tok = &body[j];
+        int param = MACRO_BODY_LITERAL;
+        if (tok->type == TOK_IDENTIFIER)
+        {
+            if (def->variadic && tok->data.str == va_args_ident)
+                param = MACRO_BODY_VA_ARGS;
+            else if (def->variadic && tok->data.str == va_count_ident)
+                param = MACRO_BODY_VA_COUNT;
+            else
+                for (int k = 0; k < def->args.size; ++k)
+                    if (def_args[k].data.str == tok->data.str)
+                    {
+                        param = k;
+                        break;
+                    }
+        }
+        def->body_params[j] = param;
+        if (param >= 0 && j > 0 && body[j-1].type == TOK_HASH)
+            def->stringifies = 1;
+    }
+}
+
 typedef struct if_contents_t
 {
     enum
@@ -221,6 +598,7 @@ typedef struct if_contents_t
     } cond_type;
     source_location_t arg_loc;
     int               arg_len;
+    int active; // the branch taken by the chain
     token_list_t condition;
     token_list_t tokens;
 
@@ -236,41 +614,122 @@ typedef enum parse_if_flags
 } parse_if_flags;
 
 
+int test_if_condition(const if_contents_t* if_contents);
+
+// skips an inactive branch without lexing it : only the nested conditionals, the comments and the string literals
+// are tracked. stops with loc->ptr on the name of the '#elif', '#else' or '#endif' that ends the branch
+static void skip_inactive_branch(source_location_t* loc, const source_location_t* if_loc, int if_len)
+{
+    const char* branch_start = loc->ptr;
+    const char* ptr = branch_start;
+    int depth = 0;
+
+    while (*(ptr = scan_skipped_text(ptr)))
+    {
+        if (*ptr == '"')
+        {
+            // an unterminated literal ends with its line
+            for (++ptr; *ptr && *ptr != '"' && !is_newline(ptr); ++ptr)
+                if (*ptr == '\\' && ptr[1])
+                    ++ptr;
+            if (*ptr == '"')
+                ++ptr;
+        }
+        else if (*ptr == '/')
+        {
+            if (ptr[1] == '*')
+            {
+                ptr = scan_block_comment(ptr + 2);
+                if (*ptr)
+                    ptr += 2;
+            }
+            else if (ptr[1] == '/')
+                ptr = scan_line_end(ptr);
+            else
+                ++ptr;
+        }
+        else
+        {
+            // the '#' has to start its line
+            const char* line_start = ptr;
+            while (line_start > branch_start && (line_start[-1] == ' ' || line_start[-1] == '\t'))
+                --line_start;
+            ++ptr;
+            if (line_start > branch_start && line_start[-1] != '\n' && line_start[-1] != '\r')
+                continue;
+
+            while (*ptr == ' ' || *ptr == '\t')
+                ++ptr;
+            if (strncmp(ptr, "if", 2) == 0)
+                ++depth;
+            else if (depth == 0 && (strncmp(ptr, "endif", 5) == 0 ||
+                                    strncmp(ptr, "elif", 4 ) == 0 ||
+                                    strncmp(ptr, "else", 4 ) == 0))
+            {
+                loc->ptr = ptr;
+                return;
+            }
+            else if (strncmp(ptr, "endif", 5) == 0)
+                --depth;
+        }
+    }
+
+    error(*if_loc, if_len, "unterminated conditional directive\n");
+}
+
 // UGLIEST FUNCTION EVEEEER
-if_contents_t* parse_if_chain(source_location_t* loc, parse_if_flags flags)
+// the conditions are tested as they are reached, so that the directives of the taken branch see the macros defined before them.
+// '*branch_taken' is set once a branch of the chain is taken, the following ones are skipped without being lexed
+if_contents_t* parse_if_chain(source_location_t* loc, parse_if_flags flags, int* branch_taken)
 {        
     if_contents_t* contents = danpa_alloc(sizeof(if_contents_t));
     DYNARRAY_INIT(contents->condition, 4);
-    DYNARRAY_INIT(contents->tokens, 256);
     DYNARRAY_INIT(contents->elifs, 4);
     contents->else_branch = NULL;
+    contents->active = 0;
 
     if (strncmp(loc->ptr, "ifdef"      , 5) == 0)
         contents->cond_type = PP_IFDEF;
     else if (strncmp(loc->ptr, "ifndef", 6) == 0)
         contents->cond_type = PP_IFNDEF;
-    else if (strncmp(loc->ptr, "if"    , 2) == 0)
+    else if (strncmp(loc->ptr, "if"    , 2) == 0 ||
+             strncmp(loc->ptr, "elif"  , 4) == 0)
         contents->cond_type = PP_IF_EXPR;
 
     // skip to args
+    const source_location_t if_loc = *loc;
     while (*loc->ptr && !isspace(*loc->ptr))
         ++loc->ptr;
+    const int if_len = loc->ptr - if_loc.ptr;
 
     skip_whitespace(loc, 0);
 
     contents->arg_loc = *loc;
-    if (NULL == do_tokenization(&contents->condition, loc, STOP_ON_NEWLINE))
+    // once a branch is taken, the conditions of the following ones don't matter
+    if (*branch_taken)
+        loc->ptr = scan_line_end(loc->ptr);
+    else if (NULL == do_tokenization(&contents->condition, loc, STOP_ON_NEWLINE))
         error(*loc, 1, "expected macro condition\n");
     contents->arg_len = loc->ptr - contents->arg_loc.ptr;
 
+    // 'else' branches have no condition
+    if (!*branch_taken && (flags == StopOnEndif || test_if_condition(contents)))
+        contents->active = *branch_taken = 1;
+
+    DYNARRAY_INIT(contents->tokens, contents->active ? 256 : 0);
+
     skip_newline(&loc->ptr);
-    update_loc_newline(loc, loc->ptr);
 
     do
     {
-        do
+        if (!contents->active)
+            skip_inactive_branch(loc, &if_loc, if_len);
+        else do
         {
             do_tokenization(&contents->tokens, loc, STOP_ON_PREPROC);
+            if (!*loc->ptr)
+                error(if_loc, if_len, "unterminated conditional directive\n");
+            const char* directive = loc->ptr;
             ++loc->ptr;
             skip_whitespace(loc, 0);
 
@@ -278,6 +737,14 @@ if_contents_t* parse_if_chain(source_location_t* loc, parse_if_flags flags)
                 strncmp(loc->ptr, "ifndef", 6) == 0 ||
                 strncmp(loc->ptr, "if"    , 2) == 0)
                 handle_if_chain(&contents->tokens, loc);
+            else if (*loc->ptr &&
+                     strncmp(loc->ptr, "endif", 5) != 0 &&
+                     strncmp(loc->ptr, "elif", 4 ) != 0 &&
+                     strncmp(loc->ptr, "else", 4 ) != 0)
+            {
+                loc->ptr = directive;
+                loc->ptr = handle_preprocessing_directives(&contents->tokens, loc);
+            }
         } while (*loc->ptr &&
                  (strncmp(loc->ptr, "endif", 5) != 0 &&
                   strncmp(loc->ptr, "elif", 4 ) != 0 &&
@@ -288,10 +755,9 @@ if_contents_t* parse_if_chain(source_location_t* loc, parse_if_flags flags)
         if (strncmp(loc->ptr, "endif", 5) == 0 && flags == StopOnEndif)
             goto out;
 
-        if (strncmp(loc->ptr, "elif", 4) == 0)
+        while (strncmp(loc->ptr, "elif", 4) == 0)
         {
-            DYNARRAY_ADD(contents->elifs, parse_if_chain(loc, StopOnElifElseEndif));
-            contents->elifs.ptr[contents->elifs.size-1]->cond_type = PP_IF_EXPR;
+            DYNARRAY_ADD(contents->elifs, parse_if_chain(loc, StopOnElifElseEndif, branch_taken));
         }
 
         if (flags == StopOnElifElseEndif)
@@ -300,43 +766,51 @@ if_contents_t* parse_if_chain(source_location_t* loc, parse_if_flags flags)
             goto out;
         if (strncmp(loc->ptr, "else", 4) == 0)
         {
-            contents->else_branch = parse_if_chain(loc, StopOnEndif);
+            contents->else_branch = parse_if_chain(loc, StopOnEndif, branch_taken);
         }
         if (flags == StopOnElifElseEndif || flags == StopOnEndif)
             goto out;
     } while (strncmp(loc->ptr, "endif", 5) != 0);
 
-    // skip the endif
-    while (*loc->ptr && !is_newline(loc->ptr))
-        ++loc->ptr;
-    skip_newline(&loc->ptr);
-    update_loc_newline(loc, loc->ptr);
+    // skip the endif. the newline is left to the caller, so that a directive on the next line is recognized
+    loc->ptr = scan_line_end(loc->ptr);
 
     out:
     return contents;
 }
 
+static void record_tested_macros(const token_list_t* condition)
+{
+    for (int i = 0; i < condition->size; ++i)
+    {
+        if (condition->ptr[i].type != TOK_IDENTIFIER)
+            continue;
+
+        int known = 0;
+        for (int j = 0; j < tested_macros.size && !known; ++j)
+            known = tested_macros.ptr[j] == condition->ptr[i].data.str;
+        if (!known)
+            DYNARRAY_ADD(tested_macros, condition->ptr[i].data.str);
+    }
+}
+
 int test_if_condition(const if_contents_t* if_contents)
 {
     if (if_contents->cond_type == PP_IF_EXPR)
     {
         token_list_t token_list;
         token_list_t* tokens = &token_list;
-        DYNARRAY_INIT(*tokens, if_contents->condition.size);
-        DYNARRAY_RESIZE(*tokens, if_contents->condition.size);
+        DYNARRAY_INIT_EXACT(*tokens, if_contents->condition.size);
         memcpy(tokens->ptr, if_contents->condition.ptr, if_contents->condition.size * sizeof(token_t));
 
         token_list_t copy_token_list;
         DYNARRAY_INIT(copy_token_list, 16);
+        if (building_pch)
+            record_tested_macros(tokens);
         // expand argument
-        for (int i = 0; i < 16; ++i)
-        {
-            DYNARRAY_RESIZE(copy_token_list, 0);
-            do_macro_expansion(tokens, &copy_token_list, 1);
-
-            DYNARRAY_RESIZE(*tokens, copy_token_list.size);
-            memcpy(tokens->ptr, copy_token_list.ptr, copy_token_list.size*sizeof(token_t));
-        }
+        expand_macros(tokens, &copy_token_list, 1);
+        if (building_pch)
+            record_tested_macros(tokens);
 
         return pp_evaluate_expr(tokens);
     }
@@ -346,252 +820,924 @@ int test_if_condition(const if_contents_t* if_contents)
             error(if_contents->arg_loc, if_contents->arg_len, "expected macro name\n");
 
         const char* name = if_contents->condition.ptr[0].data.str;
+        if (building_pch)
+            record_tested_macros(&if_contents->condition);
 
-        if (hash_table_get(&macro_definitions, name))
+        if (hash_table_get_interned(&macro_definitions, name))
             return if_contents->cond_type == PP_IFDEF;
         else
             return if_contents->cond_type == PP_IFNDEF;
     }
 }
 
+static void add_branch_tokens(token_list_t* tokens, const if_contents_t* branch)
+{
+    for (int k = 0; k < branch->tokens.size; ++k)
+        DYNARRAY_ADD(*tokens, branch->tokens.ptr[k]);
+}
+
 void handle_if_chain(token_list_t* tokens, source_location_t* loc)
 {
-    if_contents_t* if_chain = parse_if_chain(loc, 0);
+    int branch_taken = 0;
+    if_contents_t* if_chain = parse_if_chain(loc, 0, &branch_taken);
+
+    if (if_chain->active)
+        add_branch_tokens(tokens, if_chain);
+    for (int i = 0; i < if_chain->elifs.size; ++i)
+        if (if_chain->elifs.ptr[i]->active)
+            add_branch_tokens(tokens, if_chain->elifs.ptr[i]);
+    if (if_chain->else_branch && if_chain->else_branch->active)
+        add_branch_tokens(tokens, if_chain->else_branch);
+}
 
-    if (test_if_condition(if_chain))
+// a copy of the token's location, marked as coming from a macro expansion
+static loc_id_t expansion_location(const token_t* tok, token_t* invok_tok, int invok_type)
+{
+    source_location_t loc = *token_loc(tok);
+    loc.macro_invok_token = invok_tok;
+    loc.macro_invok_type = invok_type;
+    return add_location(&loc);
+}
+
+// Macro expansion follows Prosser's algorithm : every token carries a hide set, the macros it was produced by.
+// A macro name is never expanded again by a token which has it in its hide set, so the replacement lists
+// can be rescanned as they are produced, in a single pass over the tokens.
+
+// a hide set is a list of macro names sorted by address, stored as a chain of nodes. 0 is the empty set.
+// the sets only live during an expand_macros() call
+typedef struct hide_set_node_t
+{
+    const char* name;
+    uint32_t next;
+} hide_set_node_t;
+
+static hide_set_node_t* hide_set_nodes;
+static uint32_t hide_set_count;
+static uint32_t hide_set_capacity;
+
+static uint32_t hide_set_cons(const char* name, uint32_t next)
+{
+    if (hide_set_count >= hide_set_capacity)
     {
-        for (int k = 0; k < if_chain->tokens.size; ++k)
-            DYNARRAY_ADD(*tokens, if_chain->tokens.ptr[k]);
+        hide_set_capacity = hide_set_capacity ? hide_set_capacity*2 : 256;
+        if (hide_set_nodes)
+            hide_set_nodes = danpa_realloc(hide_set_nodes, hide_set_capacity*sizeof(hide_set_node_t));
+        else
+            hide_set_nodes = danpa_alloc_in(REGION_GLOBAL, hide_set_capacity*sizeof(hide_set_node_t));
     }
+
+    hide_set_nodes[hide_set_count] = (hide_set_node_t){.name = name, .next = next};
+    return hide_set_count++;
+}
+
+static int hide_set_contains(uint32_t set, const char* name)
+{
+    for (; set != 0 && (uintptr_t)hide_set_nodes[set].name <= (uintptr_t)name; set = hide_set_nodes[set].next)
+        if (hide_set_nodes[set].name == name)
+            return 1;
+    return 0;
+}
+
+static uint32_t hide_set_union(uint32_t a, uint32_t b)
+{
+    if (a == 0 || a == b)
+        return b;
+    if (b == 0)
+        return a;
+
+    // copies : hide_set_cons() may move the nodes
+    const hide_set_node_t node_a = hide_set_nodes[a];
+    const hide_set_node_t node_b = hide_set_nodes[b];
+    if (node_a.name == node_b.name)
+        return hide_set_cons(node_a.name, hide_set_union(node_a.next, node_b.next));
+    else if ((uintptr_t)node_a.name < (uintptr_t)node_b.name)
+        return hide_set_cons(node_a.name, hide_set_union(node_a.next, b));
+    else
+        return hide_set_cons(node_b.name, hide_set_union(a, node_b.next));
+}
+
+static uint32_t hide_set_intersection(uint32_t a, uint32_t b)
+{
+    if (a == b)
+        return a;
+    if (a == 0 || b == 0)
+        return 0;
+
+    const hide_set_node_t node_a = hide_set_nodes[a];
+    const hide_set_node_t node_b = hide_set_nodes[b];
+    if (node_a.name == node_b.name)
+        return hide_set_cons(node_a.name, hide_set_intersection(node_a.next, node_b.next));
+    else if ((uintptr_t)node_a.name < (uintptr_t)node_b.name)
+        return hide_set_intersection(node_a.next, b);
     else
+        return hide_set_intersection(a, node_b.next);
+}
+
+// macro arguments are expanded on their own before being substituted, this bounds the recursion
+#define MAX_MACRO_ARG_NESTING 256
+
+typedef struct expansion_t
+{
+    const token_t* input;
+    int input_size;
+    int input_pos;
+    token_list_t pending; // replacement tokens waiting to be rescanned, the next one last
+    int test_for_defined;
+    int depth;
+} expansion_t;
+
+static const token_t* peek_expansion_token(expansion_t* ex)
+{
+    if (ex->pending.size)
+        return &ex->pending.ptr[ex->pending.size-1];
+    if (ex->input_pos < ex->input_size)
+        return &ex->input[ex->input_pos];
+    return NULL;
+}
+
+static int next_expansion_token(expansion_t* ex, token_t* tok)
+{
+    if (ex->pending.size)
+    {
+        *tok = ex->pending.ptr[ex->pending.size-1];
+        DYNARRAY_POP(ex->pending);
+        return 1;
+    }
+    if (ex->input_pos < ex->input_size)
+    {
+        *tok = ex->input[ex->input_pos++];
+        return 1;
+    }
+    return 0;
+}
+
+static void expand_token_list(const token_t* tokens, int count, token_list_t* output, int test_for_defined, int depth);
+
+// substitutes a macro argument, expanded beforehand.
+// the argument's tokens are marked as coming from 'param_tok', the tokens their own expansion produces point to their invocation
+// the first token takes the spacing of what it replaces, 'leading_space'
+static void substitute_argument(const token_list_t* arg, token_t* param_tok, int invok_type, int leading_space,
+                                token_list_t* output, int test_for_defined, int depth)
+{
+    token_list_t marked;
+    DYNARRAY_INIT(marked, arg->size ? arg->size : 1);
+    for (int i = 0; i < arg->size; ++i)
     {
-        for (int i = 0; i < if_chain->elifs.size; ++i)
+        token_t arg_tok = arg->ptr[i];
+        arg_tok.loc_id = expansion_location(&arg_tok, param_tok, invok_type);
+        if (i == 0)
+            arg_tok.leading_space = leading_space;
+        DYNARRAY_ADD(marked, arg_tok);
+    }
+
+    expand_token_list(marked.ptr, marked.size, output, test_for_defined, depth + 1);
+}
+
+// Function-like macros are often invoked again with the same arguments : the replacement of an invocation, with the
+// arguments expanded but before it is rescanned, is cached. It only depends on the macro, on the argument tokens and
+// on the macros defined at that point, so the cache is emptied whenever a macro is defined.
+// On a hit, the replacement is copied and its locations are rewritten to point to the new invocation. The replacements
+// holding tokens produced by the expansion of an argument aren't cached, their locations couldn't be rewritten :
+// the invocations inside the arguments are cached on their own.
+
+#define EXPANSION_CACHE_BUCKETS 4096
+#define EXPANSION_CACHE_MAX_ENTRIES 16384
+
+// where a cached replacement token comes from, to rewrite its location on a hit.
+// an origin >= 0 is the index of the argument token passed through, the new invocation's token at that index is used instead
+enum
+{
+    CACHED_FROM_INVOCATION = -1, // a body token, attributed to the invocation
+    CACHED_FROM_BODY       = -2, // keeps its location
+    NOT_CACHEABLE          = -3  // produced by the expansion of an argument
+};
+
+// the token hide sets of an entry are saved as their macro names, as they don't outlive an expand_macros() call :
+// saved set i (0 is the empty set) spans set_names[set_starts[i-1]] to set_names[set_starts[i]-1]
+struct expansion_cache_entry_t
+{
+    const macro_def_t* def;
+    int test_for_defined;
+    uint64_t hash;
+    int arg_count;
+    int* arg_sizes;
+    token_t* arg_tokens; // the arguments, one after the other
+    int token_count;
+    token_t* tokens;
+    int* origins;
+    const char** set_names;
+    int* set_starts;
+    struct expansion_cache_entry_t* next;
+};
+
+static void clear_expansion_cache()
+{
+    if (expansion_cache)
+        memset(expansion_cache, 0, EXPANSION_CACHE_BUCKETS*sizeof(expansion_cache_entry_t*));
+    expansion_cache_count = 0;
+}
+
+// the spelling of the token, the location aside
+static uint64_t token_value_hash(const token_t* tok)
+{
+    uint32_t bits;
+    switch (tok->type)
+    {
+        case TOK_IDENTIFIER:
+            return get_interned(tok->data.str)->hash;
+        case TOK_INTEGER_LITERAL:
+            return (uint32_t)tok->data.integer;
+        case TOK_FLOAT_LITERAL:
+            memcpy(&bits, &tok->data.fp, sizeof(bits));
+            return bits;
+        case TOK_OPERATOR:
+            return tok->data.op;
+        case TOK_STRING_LITERAL:
+            return str_hash_n(tok->data.slice.ptr, tok->data.slice.length);
+        default:
+            return 0;
+    }
+}
+
+// the spacing counts too, as stringification keeps it
+static int same_token_value(const token_t* a, const token_t* b)
+{
+    if (a->type != b->type || a->leading_space != b->leading_space)
+        return 0;
+    switch (a->type)
+    {
+        case TOK_IDENTIFIER:
+            return a->data.str == b->data.str;
+        case TOK_INTEGER_LITERAL:
+            return a->data.integer == b->data.integer;
+        case TOK_FLOAT_LITERAL:
+            return memcmp(&a->data.fp, &b->data.fp, sizeof(float)) == 0;
+        case TOK_OPERATOR:
+            return a->data.op == b->data.op;
+        case TOK_STRING_LITERAL:
+            return a->data.slice.length == b->data.slice.length &&
+                   memcmp(a->data.slice.ptr, b->data.slice.ptr, a->data.slice.length) == 0;
+        default:
+            return 1;
+    }
+}
+
+#define HASH_MIX(hash, value) ((hash) = ((hash) << 5) + (hash) + (uint64_t)(value))
+
+// returns 0 if the expansion can't be cached : __FILE__ and __LINE__ depend on where the arguments are
+static int hash_invocation(const macro_def_t* def, int test_for_defined, const token_list_t* args, int arg_count, uint64_t* hash)
+{
+    uint64_t h = 5381;
+    HASH_MIX(h, (uintptr_t)def);
+    HASH_MIX(h, test_for_defined);
+    for (int k = 0; k < arg_count; ++k)
+    {
+        HASH_MIX(h, args[k].size);
+        for (int i = 0; i < args[k].size; ++i)
+        {
+            const token_t* tok = &args[k].ptr[i];
+            if (tok->type == TOK_IDENTIFIER && (tok->data.str == file_ident || tok->data.str == line_ident))
+                return 0;
+            HASH_MIX(h, tok->type);
+            HASH_MIX(h, token_value_hash(tok));
+            for (uint32_t set = tok->hide_set; set != 0; set = hide_set_nodes[set].next)
+                HASH_MIX(h, (uintptr_t)hide_set_nodes[set].name);
+        }
+    }
+    *hash = h;
+    return 1;
+}
+
+static int hide_set_matches(uint32_t set, const expansion_cache_entry_t* entry, uint32_t saved)
+{
+    if (saved == 0)
+        return set == 0;
+    for (int i = entry->set_starts[saved-1]; i < entry->set_starts[saved]; ++i, set = hide_set_nodes[set].next)
+        if (set == 0 || hide_set_nodes[set].name != entry->set_names[i])
+            return 0;
+    return set == 0;
+}
+
+static expansion_cache_entry_t* find_cached_expansion(const macro_def_t* def, int test_for_defined, uint64_t hash,
+                                                      const token_list_t* args, int arg_count)
+{
+    if (!expansion_cache)
+        return NULL;
+
+    for (expansion_cache_entry_t* entry = expansion_cache[hash % EXPANSION_CACHE_BUCKETS]; entry; entry = entry->next)
+    {
+        if (entry->hash != hash || entry->def != def || entry->test_for_defined != test_for_defined || entry->arg_count != arg_count)
+            continue;
+
+        const token_t* cached = entry->arg_tokens;
+        int match = 1;
+        for (int k = 0; k < arg_count && match; ++k)
+        {
+            match = args[k].size == entry->arg_sizes[k];
+            for (int i = 0; i < args[k].size && match; ++i, ++cached)
+                match = same_token_value(&args[k].ptr[i], cached) && hide_set_matches(args[k].ptr[i].hide_set, entry, cached->hide_set);
+        }
+        if (match)
+            return entry;
+    }
+    return NULL;
+}
+
+// saves the hide sets of an entry. with no output arrays, only counts what is needed
+typedef struct hide_set_saver_t
+{
+    const char** names;
+    int* starts;
+    int name_count;
+    int set_count;
+    uint32_t last_set, last_saved; // most tokens share their hide set with the previous one
+} hide_set_saver_t;
+
+static uint32_t save_hide_set(hide_set_saver_t* saver, uint32_t set)
+{
+    if (set == 0)
+        return 0;
+    if (set == saver->last_set)
+        return saver->last_saved;
+
+    for (uint32_t node = set; node != 0; node = hide_set_nodes[node].next)
+    {
+        if (saver->names)
+            saver->names[saver->name_count] = hide_set_nodes[node].name;
+        ++saver->name_count;
+    }
+    ++saver->set_count;
+    if (saver->starts)
+        saver->starts[saver->set_count] = saver->name_count;
+
+    saver->last_set = set;
+    saver->last_saved = saver->set_count;
+    return saver->set_count;
+}
+
+static uint32_t restore_hide_set(const expansion_cache_entry_t* entry, uint32_t saved)
+{
+    if (saved == 0)
+        return 0;
+    uint32_t set = 0;
+    for (int i = entry->set_starts[saved]-1; i >= entry->set_starts[saved-1]; --i)
+        set = hide_set_cons(entry->set_names[i], set);
+    return set;
+}
+
+// the argument tokens substituted in a replacement, as marked by substitute_argument()
+typedef struct argument_range_t
+{
+    loc_id_t first_loc;
+    int size;
+    int first_token; // among all the argument tokens
+} argument_range_t;
+
+static int replacement_token_origin(const token_t* tok, const token_t* invok_tok, const argument_range_t* ranges, int range_count)
+{
+    for (int r = 0; r < range_count; ++r)
+        if (tok->loc_id >= ranges[r].first_loc && tok->loc_id < ranges[r].first_loc + ranges[r].size)
+            return ranges[r].first_token + (tok->loc_id - ranges[r].first_loc);
+
+    const source_location_t* loc = token_loc(tok);
+    if (loc->macro_invok_token == invok_tok)
+        return CACHED_FROM_INVOCATION;
+    // the body's own tokens are at most included
+    if (!loc->macro_invok_token || loc->macro_invok_type == INCLUDED_TOKEN)
+        return CACHED_FROM_BODY;
+    return NOT_CACHEABLE;
+}
+
+static void cache_expansion(const macro_def_t* def, int test_for_defined, uint64_t hash,
+                            const token_list_t* args, int arg_count, const token_t* invok_tok,
+                            const token_list_t* replacement, const argument_range_t* ranges, int range_count)
+{
+    for (int j = 0; j < replacement->size; ++j)
+        if (replacement_token_origin(&replacement->ptr[j], invok_tok, ranges, range_count) == NOT_CACHEABLE)
+            return;
+
+    if (!expansion_cache)
+    {
+        expansion_cache = danpa_alloc(EXPANSION_CACHE_BUCKETS*sizeof(expansion_cache_entry_t*));
+        clear_expansion_cache();
+    }
+    // the cache doesn't grow past a fixed size, the entries aren't released though
+    if (expansion_cache_count >= EXPANSION_CACHE_MAX_ENTRIES)
+        clear_expansion_cache();
+
+    expansion_cache_entry_t* entry = danpa_alloc(sizeof(expansion_cache_entry_t));
+    entry->def = def;
+    entry->test_for_defined = test_for_defined;
+    entry->hash = hash;
+    entry->arg_count = arg_count;
+    entry->arg_sizes = danpa_alloc((arg_count + 1)*sizeof(int));
+    int arg_token_count = 0;
+    for (int k = 0; k < arg_count; ++k)
+    {
+        entry->arg_sizes[k] = args[k].size;
+        arg_token_count += args[k].size;
+    }
+
+    // the hide sets are counted first, then saved
+    hide_set_saver_t saver = {0};
+    for (int k = 0; k < arg_count; ++k)
+        for (int i = 0; i < args[k].size; ++i)
+            save_hide_set(&saver, args[k].ptr[i].hide_set);
+    for (int j = 0; j < replacement->size; ++j)
+        save_hide_set(&saver, replacement->ptr[j].hide_set);
+    entry->set_names = danpa_alloc((saver.name_count + 1)*sizeof(const char*));
+    entry->set_starts = danpa_alloc((saver.set_count + 1)*sizeof(int));
+    entry->set_starts[0] = 0;
+    saver = (hide_set_saver_t){.names = entry->set_names, .starts = entry->set_starts};
+
+    entry->arg_tokens = danpa_alloc((arg_token_count + 1)*sizeof(token_t));
+    token_t* arg_tok = entry->arg_tokens;
+    for (int k = 0; k < arg_count; ++k)
+        for (int i = 0; i < args[k].size; ++i, ++arg_tok)
+        {
+            *arg_tok = args[k].ptr[i];
+            arg_tok->hide_set = save_hide_set(&saver, arg_tok->hide_set);
+        }
+
+    entry->token_count = replacement->size;
+    entry->tokens = danpa_alloc((replacement->size + 1)*sizeof(token_t));
+    entry->origins = danpa_alloc((replacement->size + 1)*sizeof(int));
+    for (int j = 0; j < replacement->size; ++j)
+    {
+        token_t tok = replacement->ptr[j];
+        const int origin = replacement_token_origin(&tok, invok_tok, ranges, range_count);
+        tok.hide_set = save_hide_set(&saver, tok.hide_set);
+        entry->tokens[j] = tok;
+        entry->origins[j] = origin;
+    }
+
+    expansion_cache_entry_t** bucket = &expansion_cache[hash % EXPANSION_CACHE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    ++expansion_cache_count;
+}
+
+// copies a cached replacement for the invocation 'invok_tok', whose arguments match the entry's
+static void splice_cached_expansion(const expansion_cache_entry_t* entry, const token_list_t* args,
+                                    token_t* invok_tok, token_list_t* output)
+{
+    uint32_t last_saved = 0, last_set = 0;
+    for (int j = 0; j < entry->token_count; ++j)
+    {
+        token_t tok = entry->tokens[j];
+        const int origin = entry->origins[j];
+        if (origin >= 0)
+        {
+            int k = 0, index = origin;
+            while (index >= args[k].size)
+                index -= args[k++].size;
+            // the argument token, marked as coming from the same parameter
+            const source_location_t* cached_loc = token_loc(&tok);
+            const token_t* arg_tok = &args[k].ptr[index];
+            tok.data = arg_tok->data;
+            tok.length = arg_tok->length;
+            tok.loc_id = expansion_location(arg_tok, cached_loc->macro_invok_token, cached_loc->macro_invok_type);
+        }
+        else if (origin == CACHED_FROM_INVOCATION)
+            tok.loc_id = expansion_location(&tok, invok_tok, MACRO_TOKEN);
+
+        if (tok.hide_set != last_saved)
+        {
+            last_saved = tok.hide_set;
+            last_set = restore_hide_set(entry, last_saved);
+        }
+        tok.hide_set = last_set;
+        DYNARRAY_ADD(*output, tok);
+    }
+}
+
+typedef SMALL_DYNARRAY(char, 256) spelling_buffer_t;
+
+static void append_spelling(spelling_buffer_t* buf, const char* str, int length)
+{
+    SMALL_DYNARRAY_GROW(*buf, buf->size + length);
+    memcpy(SMALL_DYNARRAY_DATA(*buf) + buf->size, str, length);
+    buf->size += length;
+}
+
+// the argument tokens can come from macro bodies or other files : the literal is rebuilt from each token's spelling,
+// with a single space wherever there was whitespace before a token
+static void stringify_argument(const token_list_t* arg, token_t* string_tok)
+{
+    spelling_buffer_t buf;
+    SMALL_DYNARRAY_INIT(buf);
+
+    for (int i = 0; i < arg->size; ++i)
+    {
+        const token_t* tok = &arg->ptr[i];
+        const source_location_t* loc = token_loc(tok);
+        if (i > 0 && tok->leading_space)
+            append_spelling(&buf, " ", 1);
+
+        char number[32];
+        switch (tok->type)
+        {
+            case TOK_IDENTIFIER:
+                append_spelling(&buf, tok->data.str, strlen(tok->data.str));
+                break;
+            case TOK_OPERATOR:
+                append_spelling(&buf, operators[tok->data.op].str, strlen(operators[tok->data.op].str));
+                break;
+            case TOK_INTEGER_LITERAL:
+                append_spelling(&buf, number, snprintf(number, sizeof(number), "%d", tok->data.integer));
+                break;
+            case TOK_FLOAT_LITERAL:
+                append_spelling(&buf, loc->ptr, tok->length);
+                break;
+            case TOK_STRING_LITERAL:
+                // the quotes and backslashes of string literals are escaped
+                append_spelling(&buf, "\\\"", 2);
+                for (int j = 0; j < tok->data.slice.length; ++j)
+                {
+                    const char c = tok->data.slice.ptr[j];
+                    if (c == '"' || c == '\\')
+                        append_spelling(&buf, "\\", 1);
+                    append_spelling(&buf, &c, 1);
+                }
+                append_spelling(&buf, "\\\"", 2);
+                break;
+            default:
+                append_spelling(&buf, tokens_str[tok->type], strlen(tokens_str[tok->type]));
+                break;
+        }
+    }
+
+    string_tok->type = TOK_STRING_LITERAL;
+    string_tok->data.slice.ptr = intern_string(SMALL_DYNARRAY_DATA(buf), buf.size);
+    string_tok->data.slice.length = buf.size;
+}
+
+// replaces the invocation of 'def' started by 'macro_tok', and pushes the replacement back to be rescanned
+static void expand_invocation(expansion_t* ex, token_t* macro_tok, const macro_def_t* def)
+{
+    macro_tok->loc_id = expansion_location(macro_tok, def->macro_ident, MACRO_TOKEN);
+
+    // the invocation record, shared by the locations of all the tokens of the replacement.
+    // it is part of these locations, which outlive the token lists
+    token_t* invok_tok = danpa_alloc_in(REGION_GLOBAL, sizeof(token_t));
+    *invok_tok = *macro_tok;
+
+    // the replacement can't expand the macro again : for a function-like macro, only the tokens
+    // which were hidden both by its name and by its closing parenthesis stay hidden
+    uint32_t hide_set = macro_tok->hide_set;
+
+    SMALL_DYNARRAY(token_list_t, 4) call_args;
+    SMALL_DYNARRAY_INIT(call_args);
+    if (def->function_like)
+    {
+        token_t tok;
+        next_expansion_token(ex, &tok); // '('
+
+        const token_t* next = peek_expansion_token(ex);
+        if (next == NULL)
+            error(*token_loc(macro_tok), macro_tok->length, "expected comma or ')'\n");
+        if (next->type != TOK_CLOSE_PARENTHESIS)
+        {
+            int parenthesis_depth = 1;
+            token_list_t arg_tokens;
+            DYNARRAY_INIT(arg_tokens, 4);
+            while (1)
+            {
+                if (!next_expansion_token(ex, &tok))
+                    error(*token_loc(macro_tok), macro_tok->length, "expected comma or ')'\n");
+
+                if (tok.type == TOK_COMMA && parenthesis_depth==1)
+                {
+                    SMALL_DYNARRAY_RESIZE(call_args, call_args.size + 1);
+                    DYNARRAY_INIT_EXACT(SMALL_DYNARRAY_BACK(call_args), arg_tokens.size);
+                    memcpy(SMALL_DYNARRAY_BACK(call_args).ptr, arg_tokens.ptr, arg_tokens.size*sizeof(token_t));
+
+                    DYNARRAY_RESIZE(arg_tokens, 0);
+                    continue;
+                }
+                else if (tok.type == TOK_OPEN_PARENTHESIS)
+                    ++parenthesis_depth;
+                else if (tok.type == TOK_CLOSE_PARENTHESIS)
+                    --parenthesis_depth;
+
+                if (parenthesis_depth == 0)
+                {
+                    SMALL_DYNARRAY_ADD(call_args, arg_tokens);
+                    break;
+                }
+
+                DYNARRAY_ADD(arg_tokens, tok);
+            }
+        }
+        else
+            next_expansion_token(ex, &tok);
+
+        hide_set = hide_set_intersection(hide_set, tok.hide_set);
+    }
+    hide_set = hide_set_union(hide_set, hide_set_cons(def->macro_ident->data.str, 0));
+
+    if ((def->variadic == 0 && call_args.size != def->args.size) ||
+        (def->variadic == 1 && call_args.size <  def->args.size))
+        error(*token_loc(macro_tok), macro_tok->length, "invalid macro argument count\n");
+
+    token_list_t replacement;
+    DYNARRAY_INIT(replacement, def->macro_tokens.size + 1);
+
+    token_list_t* call_arg_lists = SMALL_DYNARRAY_DATA(call_args);
+
+    uint64_t hash;
+    const int cacheable = def->function_like && !def->stringifies &&
+                          hash_invocation(def, ex->test_for_defined, call_arg_lists, call_args.size, &hash);
+    const expansion_cache_entry_t* cached = NULL;
+    if (cacheable && (cached = find_cached_expansion(def, ex->test_for_defined, hash, call_arg_lists, call_args.size)))
+        splice_cached_expansion(cached, call_arg_lists, invok_tok, &replacement);
+
+    // the start of each argument among all the argument tokens
+    SMALL_DYNARRAY(int, 8) arg_starts;
+    SMALL_DYNARRAY_INIT(arg_starts);
+    SMALL_DYNARRAY(argument_range_t, 8) arg_ranges;
+    SMALL_DYNARRAY_INIT(arg_ranges);
+    if (cacheable && !cached)
+    {
+        SMALL_DYNARRAY_RESIZE(arg_starts, call_args.size + 1);
+        SMALL_DYNARRAY_DATA(arg_starts)[0] = 0;
+        for (int k = 0; k < call_args.size; ++k)
+            SMALL_DYNARRAY_DATA(arg_starts)[k+1] = SMALL_DYNARRAY_DATA(arg_starts)[k] + call_arg_lists[k].size;
+    }
+
+    for (int j = 0; j < def->macro_tokens.size && !cached; ++j)
+    {
+        token_t* body_tok = &def->macro_tokens.ptr[j];
+        int param = def->body_params[j];
+
+        if (j != def->macro_tokens.size-1 &&
+            body_tok->type == TOK_HASH &&
+            def->macro_tokens.ptr[j+1].type == TOK_IDENTIFIER)
         {
-            if (test_if_condition(if_chain->elifs.ptr[i]))
+            ++j;
+            body_tok = &def->macro_tokens.ptr[j];
+            param = def->body_params[j];
+
+            if (param >= 0 && call_arg_lists[param].size)
             {
-                for (int k = 0; k < if_chain->elifs.ptr[i]->tokens.size; ++k)
-                    DYNARRAY_ADD(*tokens, if_chain->elifs.ptr[i]->tokens.ptr[k]);
+                // the argument is stringified before being expanded
+                token_t string_tok = *body_tok;
+                string_tok.leading_space = def->macro_tokens.ptr[j-1].leading_space; // the '#'
+                stringify_argument(&call_arg_lists[param], &string_tok);
+                string_tok.loc_id = expansion_location(body_tok, invok_tok, MACRO_TOKEN);
+                DYNARRAY_ADD(replacement, string_tok);
+                continue;
+            }
+            // only parameters can be stringified, the name is kept as is
+            param = MACRO_BODY_LITERAL;
+        }
 
-                goto out;
+        if (param >= 0)
+        {
+            if (cacheable)
+                SMALL_DYNARRAY_ADD(arg_ranges, (argument_range_t){location_count, call_arg_lists[param].size, SMALL_DYNARRAY_DATA(arg_starts)[param]});
+            substitute_argument(&call_arg_lists[param], body_tok, MACRO_ARG_TOKEN, body_tok->leading_space,
+                                &replacement, ex->test_for_defined, ex->depth);
+        }
+        else if (param == MACRO_BODY_VA_ARGS)
+        {
+            // ignore the named arguments
+            for (int k = def->args.size; k < call_args.size; ++k)
+            {
+                if (cacheable)
+                    SMALL_DYNARRAY_ADD(arg_ranges, (argument_range_t){location_count, call_arg_lists[k].size, SMALL_DYNARRAY_DATA(arg_starts)[k]});
+                // the arguments past the first one keep their own spacing, after the comma
+                const int leading_space = k == def->args.size ? body_tok->leading_space
+                                                              : call_arg_lists[k].size && call_arg_lists[k].ptr[0].leading_space;
+                substitute_argument(&call_arg_lists[k], body_tok, MACRO_TOKEN, leading_space,
+                                    &replacement, ex->test_for_defined, ex->depth);
+                if (k != call_args.size-1)
+                {
+                    token_t comma = *body_tok;
+                    comma.type = TOK_COMMA;
+                    comma.loc_id = expansion_location(body_tok, invok_tok, MACRO_TOKEN);
+                    DYNARRAY_ADD(replacement, comma);
+                }
+            }
+            // if there was no variadic arguments sent, delete the last comma
+            if (def->args.size >= call_args.size)
+            {
+                assert(replacement.ptr[replacement.size-1].type == TOK_COMMA);
+                DYNARRAY_POP(replacement);
             }
         }
+        else if (param == MACRO_BODY_VA_COUNT)
+        {
+            token_t count_tok = *body_tok;
+            count_tok.type = TOK_INTEGER_LITERAL;
+            count_tok.data.integer = call_args.size;
+            count_tok.loc_id = expansion_location(body_tok, invok_tok, MACRO_TOKEN);
+            DYNARRAY_ADD(replacement, count_tok);
+        }
+        else
+        {
+            token_t literal_tok = *body_tok;
+            literal_tok.loc_id = expansion_location(&literal_tok, invok_tok, MACRO_TOKEN);
+            DYNARRAY_ADD(replacement, literal_tok);
+        }
+    }
+
+    if (cacheable && !cached)
+        cache_expansion(def, ex->test_for_defined, hash, call_arg_lists, call_args.size, invok_tok,
+                        &replacement, SMALL_DYNARRAY_DATA(arg_ranges), arg_ranges.size);
 
-        // no condition succeded, let's do the else if it exists
-        if (if_chain->else_branch)
+    // the replacement takes the spacing of the invocation
+    if (replacement.size)
+        replacement.ptr[0].leading_space = invok_tok->leading_space;
+
+    // add the macro to the hide sets, most tokens share the same one
+    uint32_t last_set = 0, last_union = hide_set;
+    for (int j = 0; j < replacement.size; ++j)
+    {
+        if (replacement.ptr[j].hide_set != last_set)
         {
-            for (int k = 0; k < if_chain->else_branch->tokens.size; ++k)
-                DYNARRAY_ADD(*tokens, if_chain->else_branch->tokens.ptr[k]);
+            last_set = replacement.ptr[j].hide_set;
+            last_union = hide_set_union(last_set, hide_set);
         }
+        replacement.ptr[j].hide_set = last_union;
     }
 
-out:
-    return;
+    // rescan the replacement before the rest of the input
+    for (int j = replacement.size-1; j >= 0; --j)
+        DYNARRAY_ADD(ex->pending, replacement.ptr[j]);
 }
 
-void do_macro_expansion(token_list_t* tokens, token_list_t* expanded_list, int test_for_defined)
+static void expand_token_list(const token_t* tokens, int count, token_list_t* output, int test_for_defined, int depth)
 {
-    for (int i = 0; i < tokens->size; ++i)
+    if (depth > MAX_MACRO_ARG_NESTING && count > 0)
+        error(*token_loc(&tokens[0]), tokens[0].length, "macro arguments nested too deeply (%d levels)\n", depth);
+
+    expansion_t ex;
+    ex.input = tokens;
+    ex.input_size = count;
+    ex.input_pos = 0;
+    ex.test_for_defined = test_for_defined;
+    ex.depth = depth;
+    DYNARRAY_INIT(ex.pending, 16);
+
+    token_t tok;
+    while (next_expansion_token(&ex, &tok))
     {
-        macro_def_t def;
+        const macro_def_t* def;
         hash_value_t* val;
+        const token_t* next;
 
+        if (tok.type != TOK_IDENTIFIER)
+        {
+            DYNARRAY_ADD(*output, tok);
+        }
         // handle 'defined(...)' keywords if in macro expr
-        if (test_for_defined && tokens->ptr[i].type == TOK_IDENTIFIER && strncmp(tokens->ptr[i].data.str, "defined", 7) == 0)
+        else if (test_for_defined && strncmp(tok.data.str, "defined", 7) == 0)
         {
-            if ((i+3 < tokens->size) && tokens->ptr[i+1].type == TOK_OPEN_PARENTHESIS
-                && tokens->ptr[i+2].type == TOK_IDENTIFIER
-                && tokens->ptr[i+3].type == TOK_CLOSE_PARENTHESIS)
+            // don't expand 'defined(...)' !
+            DYNARRAY_ADD(*output, tok);
+            const token_type_t expected[3] = {TOK_OPEN_PARENTHESIS, TOK_IDENTIFIER, TOK_CLOSE_PARENTHESIS};
+            for (int j = 0; j < 3; ++j)
             {
-                // don't expand 'defined(...)' !
-                for (int j = 0; j < 4; ++j)
-                    DYNARRAY_ADD(*expanded_list, tokens->ptr[i+j]);
-                i += 4;
+                token_t operand;
+                if (!next_expansion_token(&ex, &operand) || operand.type != expected[j])
+                    error(*token_loc(&tok), tok.length, "expected macro name after 'defined'\n");
+                DYNARRAY_ADD(*output, operand);
             }
-            else
-                error(tokens->ptr[i].location, tokens->ptr[i].length, "expected macro name after 'defined'\n");
         }
-        else if (tokens->ptr[i].type == TOK_IDENTIFIER && strcmp(tokens->ptr[i].data.str, "__FILE__") == 0)
+        else if (tok.data.str == file_ident)
         {
-            token_t file_tok = tokens->ptr[i];
+            token_t file_tok = tok;
             file_tok.type = TOK_STRING_LITERAL;
-            file_tok.data.str = tokens->ptr[i].location.filename;
-            DYNARRAY_ADD(*expanded_list, file_tok);
+            const char* filename = get_source_file(token_loc(&tok)->file_id)->filename;
+            file_tok.data.slice.ptr = filename;
+            file_tok.data.slice.length = strlen(filename);
+            DYNARRAY_ADD(*output, file_tok);
         }
-        else if (tokens->ptr[i].type == TOK_IDENTIFIER && strcmp(tokens->ptr[i].data.str, "__LINE__") == 0)
+        else if (tok.data.str == line_ident)
         {
-            token_t line_tok = tokens->ptr[i];
+            token_t line_tok = tok;
             line_tok.type = TOK_INTEGER_LITERAL;
-            line_tok.data.integer = tokens->ptr[i].location.line;
-            DYNARRAY_ADD(*expanded_list, line_tok);
+            line_tok.data.integer = location_line(token_loc(&tok), NULL);
+            DYNARRAY_ADD(*output, line_tok);
         }
-        else if (tokens->ptr[i].type == TOK_IDENTIFIER && (val = hash_table_get(&macro_definitions, tokens->ptr[i].data.str)))
+        else if ((val = hash_table_get_interned(&macro_definitions, tok.data.str)) &&
+                 !hide_set_contains(tok.hide_set, tok.data.str) &&
+                 // a function-like macro name is only an invocation when followed by '('
+                 (!(def = val->macro_def)->function_like ||
+                  ((next = peek_expansion_token(&ex)) && next->type == TOK_OPEN_PARENTHESIS)))
         {
-            def = val->macro_def;
+            expand_invocation(&ex, &tok, def);
+        }
+        else
+            DYNARRAY_ADD(*output, tok);
+    }
+}
 
-            token_t* macro_tok = &tokens->ptr[i];
-            macro_tok->location.macro_invok_token = danpa_alloc(sizeof(token_t));
-            *macro_tok->location.macro_invok_token = *def.macro_ident;
-            macro_tok->location.macro_invok_type = MACRO_TOKEN;
+void expand_macros(token_list_t* tokens, token_list_t* scratch, int test_for_defined)
+{
+    // the hide sets of a previous call aren't referenced anymore
+    hide_set_count = 1;
 
-            DYNARRAY(token_list_t) call_args;
-            DYNARRAY_INIT(call_args, 4);
-            if (tokens->ptr[i+1].type == TOK_OPEN_PARENTHESIS)
-            {
-                int parenthesis_depth = 1;
-                ++i;
+    DYNARRAY_RESIZE(*scratch, 0);
+    expand_token_list(tokens->ptr, tokens->size, scratch, test_for_defined, 0);
 
-                if (tokens->ptr[i+1].type != TOK_CLOSE_PARENTHESIS)
-                {
-                    token_list_t arg_tokens;
-                    DYNARRAY_INIT(arg_tokens, 4);
-                    while (1)
-                    {
-                        if (i >= tokens->size)
-                            error(macro_tok->location, macro_tok->length, "expected comma or ')'\n");
+    token_list_t swap = *tokens; *tokens = *scratch; *scratch = swap;
+}
 
-                        if (tokens->ptr[i+1].type == TOK_COMMA && parenthesis_depth==1)
-                        {
-                            ++i;
-                            DYNARRAY_RESIZE(call_args, call_args.size + 1);
-                            DYNARRAY_INIT  (call_args.ptr[call_args.size-1], arg_tokens.size);
-                            DYNARRAY_RESIZE(call_args.ptr[call_args.size-1], arg_tokens.size);
-                            memcpy(call_args.ptr[call_args.size-1].ptr, arg_tokens.ptr, arg_tokens.size*sizeof(token_t));
+// make needs spaces, '#' and '$' escaped
+static void write_make_path(FILE* output, const char* path)
+{
+    for (; *path; ++path)
+    {
+        if (*path == ' ' || *path == '#')
+            fputc('\\', output);
+        else if (*path == '$')
+            fputc('$', output);
+        fputc(*path, output);
+    }
+}
 
-                            DYNARRAY_RESIZE(arg_tokens, 0);
-                            continue;
-                        }
-                        else if (tokens->ptr[i+1].type == TOK_OPEN_PARENTHESIS)
-                        {
-                            ++parenthesis_depth;
-                        }
-                        else if (tokens->ptr[i+1].type == TOK_CLOSE_PARENTHESIS)
-                        {
-                            --parenthesis_depth;
-                            if (parenthesis_depth < 0)
-                                error(tokens->ptr[i+1].location, tokens->ptr[i+1].length, "unexpected ')'\n");
-                        }
-                        if (parenthesis_depth == 0)
-                        {
-                            ++i;
-                            DYNARRAY_ADD(call_args, arg_tokens);
-                            break;
-                        }
+int write_dependencies(const char* path, const char* target, const char* input)
+{
+    FILE* output = fopen(path, "wb");
+    if (!output)
+        return 0;
 
-                        DYNARRAY_ADD(arg_tokens, tokens->ptr[i+1]);
-                        ++i;
-                    }
-                }
-                else
-                    ++i;
-            }
+    write_make_path(output, target);
+    fputs(":", output);
+    if (input)
+    {
+        fputs(" ", output);
+        write_make_path(output, input);
+    }
+    // the files are listed as they were first included. the ones in inactive #if branches were never opened
+    for (int i = 0; i < include_entries.size; ++i)
+    {
+        fputs(" \\\n  ", output);
+        write_make_path(output, get_source_file(include_entries.ptr[i]->file_id)->filename);
+    }
+    fputs("\n", output);
+
+    return fclose(output) == 0;
+}
 
-            if ((def.variadic == 0 && call_args.size != def.args.size) ||
-                (def.variadic == 1 && call_args.size <  def.args.size))
-                error(macro_tok->location, macro_tok->length, "invalid macro argument count\n");
+static precompiled_header_t* collected_pch;
 
-            for (int j = 0; j < def.macro_tokens.size; ++j)
-            {
-                int is_arg = 0;
-                if (j != def.macro_tokens.size-1 &&
-                    def.macro_tokens.ptr[j].type == TOK_HASH &&
-                    def.macro_tokens.ptr[j+1].type == TOK_IDENTIFIER)
-                {
-                    ++j;
+static void collect_macro(hash_node_t* node)
+{
+    DYNARRAY_ADD(collected_pch->macros, node->value.macro_def);
+}
 
-                    for (int k = 0; k < def.args.size; ++k)
-                        if (strcmp(def.args.ptr[k].data.str, def.macro_tokens.ptr[j].data.str) == 0 && call_args.ptr[k].size)
-                        {
-                            const char* start = call_args.ptr[k].ptr[0].location.ptr;
-                            const char* end   = call_args.ptr[k].ptr[call_args.ptr[k].size-1].location.ptr + call_args.ptr[k].ptr[call_args.ptr[k].size-1].length;
+int build_precompiled_header(const char* filename)
+{
+    building_pch = 1;
+    DYNARRAY_RESIZE(tested_macros, 0);
 
-                            char* stringified = danpa_alloc(end-start + 1);
-                            memcpy(stringified, start, end-start);
-                            stringified[end-start] = '\0';
+    include_entry_t* entry = get_include_entry(filename);
+    if (!entry)
+    {
+        building_pch = 0;
+        fprintf(stderr, "could not read header '%s'\n", filename);
+        return 0;
+    }
 
-                            token_t count_tok = def.macro_tokens.ptr[j];
-                            count_tok.type = TOK_STRING_LITERAL;
-                            count_tok.data.str = stringified;
-                            DYNARRAY_ADD(*expanded_list, count_tok);
+    precompiled_header_t pch;
+    DYNARRAY_INIT(pch.tokens, (int)(entry->size / BYTES_PER_TOKEN) + 1);
+    include_file(&pch.tokens, entry, NULL);
+    building_pch = 0;
 
-                            is_arg = 1;
-                        }
-                }
-                else if (def.macro_tokens.ptr[j].type == TOK_IDENTIFIER)
-                {
-                    // replace arguments
-                    if (def.variadic == 1 && strcmp(def.macro_tokens.ptr[j].data.str, "__VA_ARGS__") == 0)
-                    {
+    // the header comes first, as it was the first file read
+    DYNARRAY_INIT(pch.files, include_entries.size);
+    for (int i = 0; i < include_entries.size; ++i)
+    {
+        const include_entry_t* included = include_entries.ptr[i];
+        pch_file_info_t info;
+        info.path = included->path;
+        const char* name = get_source_file(included->file_id)->filename;
+        info.name = intern_string(name, strlen(name));
+        info.mtime = included->mtime;
+        info.size = included->size;
+        info.guard_macro = included->guard_macro;
+        info.pragma_once = included->pragma_once;
+        info.file_id = included->file_id;
+        DYNARRAY_ADD(pch.files, info);
+    }
 
-                        // ignore the named arguments
-                        for (int k = def.args.size; k < call_args.size; ++k)
-                        {
-                            for (int q = 0; q < call_args.ptr[k].size; ++q)
-                            {
-                                call_args.ptr[k].ptr[q].location.macro_invok_token = danpa_alloc(sizeof(token_t));
-                                *call_args.ptr[k].ptr[q].location.macro_invok_token = def.macro_tokens.ptr[j];
-                                call_args.ptr[k].ptr[q].location.macro_invok_type = MACRO_TOKEN;
-                                DYNARRAY_ADD(*expanded_list, call_args.ptr[k].ptr[q]);
-                            }
-                            if (k != call_args.size-1)
-                            {
-                                token_t comma = def.macro_tokens.ptr[j];
-                                comma.type = TOK_COMMA;
-                                DYNARRAY_ADD(*expanded_list, comma);
-                            }
-                        }
-                        // if there was no variadic arguments sent, delete the last comma
-                        if (def.args.size >= call_args.size)
-                        {
-                            assert(expanded_list->ptr[expanded_list->size-1].type == TOK_COMMA);
-                            DYNARRAY_POP(*expanded_list);
-                        }
+    DYNARRAY_INIT(pch.macros, macro_definitions.count + 1);
+    collected_pch = &pch;
+    hash_table_iterate(&macro_definitions, collect_macro);
 
-                        is_arg = 1;
-                    }
-                    else if (def.variadic == 1 && strcmp(def.macro_tokens.ptr[j].data.str, "__VA_COUNT__") == 0)
-                    {
-                        token_t count_tok = def.macro_tokens.ptr[j];
-                        count_tok.type = TOK_INTEGER_LITERAL;
-                        count_tok.data.integer = call_args.size;
-                        DYNARRAY_ADD(*expanded_list, count_tok);
+    DYNARRAY_INIT(pch.tested_macros, tested_macros.size + 1);
+    for (int i = 0; i < tested_macros.size; ++i)
+        DYNARRAY_ADD(pch.tested_macros, tested_macros.ptr[i]);
 
-                        is_arg = 1;
-                    }
-                    else
-                    {
-                        for (int k = 0; k < def.args.size; ++k)
-                            if (strcmp(def.args.ptr[k].data.str, def.macro_tokens.ptr[j].data.str) == 0)
-                            {
-                                for (int q = 0; q < call_args.ptr[k].size; ++q)
-                                {
-
-                                    call_args.ptr[k].ptr[q].location.macro_invok_token = danpa_alloc(sizeof(token_t));
-                                    *call_args.ptr[k].ptr[q].location.macro_invok_token = def.macro_tokens.ptr[j];
-                                    call_args.ptr[k].ptr[q].location.macro_invok_type = MACRO_ARG_TOKEN;
-                                    DYNARRAY_ADD(*expanded_list, call_args.ptr[k].ptr[q]);
-
-                                    /*
-                                    DYNARRAY_ADD(*expanded_list, def.macro_tokens.ptr[j]);
-                                    expanded_list->ptr[expanded_list->size-1].location.macro_invok_token  = danpa_alloc(sizeof(token_t));
-                                    *expanded_list->ptr[expanded_list->size-1].location.macro_invok_token = *macro_tok;
-                                    expanded_list->ptr[expanded_list->size-1].location.macro_invok_type = MACRO_TOKEN;
-                                    */
-                                }
-                                is_arg = 1;
-                                break;
-                            }
-                    }
-                }
-                if (is_arg)
-                    continue;
-                DYNARRAY_ADD(*expanded_list, def.macro_tokens.ptr[j]);
-                // if not an argument :
-                expanded_list->ptr[expanded_list->size-1].location.macro_invok_token  = danpa_alloc(sizeof(token_t));
-                *expanded_list->ptr[expanded_list->size-1].location.macro_invok_token = *macro_tok;
-                expanded_list->ptr[expanded_list->size-1].location.macro_invok_type = MACRO_TOKEN;
-            }
-        }
-        else
-            DYNARRAY_ADD(*expanded_list, tokens->ptr[i]);
+    const char* path = pch_path(entry->path);
+    if (!write_pch(path, &pch))
+    {
+        fprintf(stderr, "could not write precompiled header '%s'\n", path);
+        return 0;
     }
+
+    return 1;
 }
@@ -9,7 +9,16 @@ extern hash_table_t macro_definitions;
 
 void init_pp();
 
+void prefetch_includes(const char* source, size_t size);
+// preprocesses a header on its own and saves it as a precompiled header next to it (see pch.h). returns 0 on failure
+int build_precompiled_header(const char* filename);
+// writes a make rule 'target: input files...' listing every file included so far, for build systems. returns 0 on failure
+int write_dependencies(const char* path, const char* target, const char* input);
 const char* handle_preprocessing_directives(token_list_t* tokens, source_location_t *loc);
-void do_macro_expansion(token_list_t* tokens, token_list_t* expanded_list, int test_for_defined);
+// to be called once the body of a new macro definition is lexed : the body is moved to the global region,
+// where the locations of the expanded tokens can refer to it, and its parameters are resolved
+void prepare_macro_body(macro_def_t* def);
+// expands the macros of 'tokens' in place, in a single pass. 'scratch' is used as the intermediate list
+void expand_macros(token_list_t* tokens, token_list_t* scratch, int test_for_defined);
 
 #endif // PREPROCESSER_H
@@ -0,0 +1,252 @@
+/*
+scan.c
+
+Copyright (c) 26 Yann BOUCHER (yann)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "scan.h"
+
+#include <stdint.h>
+
+#define IDENT_CHAR (CC_IDENT_FIRST | CC_IDENT)
+
+const unsigned char char_class[256] =
+{
+    [' ']  = CC_SPACE,
+    ['\t'] = CC_SPACE,
+    ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE,
+    ['0' ... '9'] = CC_IDENT | CC_DIGIT,
+    ['a' ... 'z'] = IDENT_CHAR,
+    ['A' ... 'Z'] = IDENT_CHAR,
+    ['_'] = IDENT_CHAR,
+};
+
+// aligned loads never cross a page boundary, but they do read around the buffer
+#if defined(__SANITIZE_ADDRESS__)
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef SCAN_NO_SANITIZE
+#define SCAN_NO_SANITIZE
+#endif
+
+#if !defined(DANPA_NO_SIMD) && defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define SCAN_WIDTH 32
+#define SCAN_FULL_MASK 0xFFFFFFFFu
+
+typedef __m256i vec_t;
+
+// dereferenced directly : the intrinsic's own body would still be instrumented
+SCAN_NO_SANITIZE static inline vec_t vec_load(const char* ptr)
+{
+    return *(const __m256i*)ptr;
+}
+static inline uint32_t vec_eq(vec_t v, char c)
+{
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+// bytes in [lo, lo+count]
+static inline uint32_t vec_in_range(vec_t v, char lo, char count)
+{
+    const vec_t rebased = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(rebased, _mm256_set1_epi8(count)), rebased));
+}
+
+#elif !defined(DANPA_NO_SIMD) && defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define SCAN_WIDTH 16
+#define SCAN_FULL_MASK 0xFFFFu
+
+typedef __m128i vec_t;
+
+// dereferenced directly : the intrinsic's own body would still be instrumented
+SCAN_NO_SANITIZE static inline vec_t vec_load(const char* ptr)
+{
+    return *(const __m128i*)ptr;
+}
+static inline uint32_t vec_eq(vec_t v, char c)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+// bytes in [lo, lo+count]
+static inline uint32_t vec_in_range(vec_t v, char lo, char count)
+{
+    const vec_t rebased = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(rebased, _mm_set1_epi8(count)), rebased));
+}
+
+#endif
+
+#ifdef SCAN_WIDTH
+
+static inline const char* align_block(const char* ptr)
+{
+    return (const char*)((uintptr_t)ptr & ~(uintptr_t)(SCAN_WIDTH-1));
+}
+
+// mask of the bytes of the block at or after ptr
+static inline uint32_t block_keep_mask(const char* block, const char* ptr)
+{
+    return (SCAN_FULL_MASK << (ptr - block)) & SCAN_FULL_MASK;
+}
+
+// mask of the bytes below the lowest set bit of mask, all of them if there is none
+static inline uint32_t below_first(uint32_t mask)
+{
+    return mask ? (mask & -mask) - 1 : SCAN_FULL_MASK;
+}
+
+SCAN_NO_SANITIZE const char* scan_blanks(const char* ptr, int consume_newlines, int* on_new_line)
+{
+    const char* block = align_block(ptr);
+    uint32_t keep = block_keep_mask(block, ptr);
+
+    for (;; block += SCAN_WIDTH, keep = SCAN_FULL_MASK)
+    {
+        const vec_t v = vec_load(block);
+        const uint32_t lf = vec_eq(v, '\n') & keep;
+        uint32_t stop = ~(vec_eq(v, ' ') | vec_in_range(v, '\t', '\r'-'\t')) & keep;
+
+        // every newline contains a '\n', whichever way it is paired
+        if (!consume_newlines)
+            stop |= lf | (vec_eq(v, '\r') & keep);
+        else if (lf & below_first(stop))
+            *on_new_line = 1;
+
+        if (stop)
+            return block + __builtin_ctz(stop);
+    }
+}
+
+SCAN_NO_SANITIZE static const char* find_any3(const char* ptr, char a, char b, char c)
+{
+    const char* block = align_block(ptr);
+    uint32_t keep = block_keep_mask(block, ptr);
+
+    for (;; block += SCAN_WIDTH, keep = SCAN_FULL_MASK)
+    {
+        const vec_t v = vec_load(block);
+        const uint32_t found = (vec_eq(v, a) | vec_eq(v, b) | vec_eq(v, c)) & keep;
+        if (found)
+            return block + __builtin_ctz(found);
+    }
+}
+
+const char* scan_line_end(const char* ptr)
+{
+    for (;;)
+    {
+        ptr = find_any3(ptr, '\n', '\r', '\0');
+        if (*ptr != '\r' || ptr[1] == '\n')
+            return ptr;
+        ++ptr; // lone '\r'
+    }
+}
+
+const char* scan_quote(const char* ptr)
+{
+    return find_any3(ptr, '"', '\0', '\0');
+}
+
+SCAN_NO_SANITIZE const char* scan_skipped_text(const char* ptr)
+{
+    const char* block = align_block(ptr);
+    uint32_t keep = block_keep_mask(block, ptr);
+
+    for (;; block += SCAN_WIDTH, keep = SCAN_FULL_MASK)
+    {
+        const vec_t v = vec_load(block);
+        const uint32_t found = (vec_eq(v, '#') | vec_eq(v, '"') | vec_eq(v, '/') | vec_eq(v, '\0')) & keep;
+        if (found)
+            return block + __builtin_ctz(found);
+    }
+}
+
+const char* scan_block_comment(const char* ptr)
+{
+    for (;;)
+    {
+        ptr = find_any3(ptr, '*', '\0', '\0');
+        if (*ptr == '\0' || ptr[1] == '/')
+            return ptr;
+        ++ptr;
+    }
+}
+
+#else
+
+const char* scan_blanks(const char* ptr, int consume_newlines, int* on_new_line)
+{
+    for (;; ++ptr)
+    {
+        if (*ptr == '\n' || *ptr == '\r')
+        {
+            if (!consume_newlines)
+                return ptr;
+            if (*ptr == '\n')
+                *on_new_line = 1;
+        }
+        else if (!is_space_char(*ptr))
+            return ptr;
+    }
+}
+
+const char* scan_line_end(const char* ptr)
+{
+    while (*ptr && !is_newline(ptr))
+        ++ptr;
+    return ptr;
+}
+
+const char* scan_quote(const char* ptr)
+{
+    while (*ptr && *ptr != '"')
+        ++ptr;
+    return ptr;
+}
+
+const char* scan_skipped_text(const char* ptr)
+{
+    while (*ptr && *ptr != '#' && *ptr != '"' && *ptr != '/')
+        ++ptr;
+    return ptr;
+}
+
+const char* scan_block_comment(const char* ptr)
+{
+    while (*ptr && !(ptr[0] == '*' && ptr[1] == '/'))
+        ++ptr;
+    return ptr;
+}
+
+#endif
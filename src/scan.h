@@ -0,0 +1,49 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// character classes, indexed by unsigned char
+enum
+{
+    CC_SPACE       = 1 << 0,
+    CC_IDENT_FIRST = 1 << 1,
+    CC_IDENT       = 1 << 2,
+    CC_DIGIT       = 1 << 3
+};
+
+extern const unsigned char char_class[256];
+
+static inline int is_space_char(char c)
+{
+    return char_class[(unsigned char)c] & CC_SPACE;
+}
+
+static inline int is_newline(const char* ptr)
+{
+    return *ptr == '\n' || (ptr[0] == '\r' && ptr[1] == '\n');
+}
+
+static inline void skip_newline(const char** ptr)
+{
+    if (((*ptr)[0] == '\r' && (*ptr)[1] == '\n') || ((*ptr)[0] == '\n' && (*ptr)[1] == '\r'))
+        *ptr += 2;
+    else
+        ++*ptr;
+}
+
+// The scanning functions below look for the next interesting byte of a null-terminated buffer, 16 or 32 bytes at a time
+// when SSE2 or AVX2 is available (scalar otherwise).
+// They may read past the null terminator, but never past the aligned block that contains it.
+
+// skips blanks, and newlines if consume_newlines is set. stops on anything else.
+// sets *on_new_line if a newline was consumed
+const char* scan_blanks(const char* ptr, int consume_newlines, int* on_new_line);
+// returns a pointer to the next newline, or to the null terminator
+const char* scan_line_end(const char* ptr);
+// returns a pointer to the end of the block comment ("*/"), or to the null terminator
+const char* scan_block_comment(const char* ptr);
+// returns a pointer to the next '"' or to the null terminator
+const char* scan_quote(const char* ptr);
+// returns a pointer to the next '#', '"' or '/', or to the null terminator : the bytes that matter in an inactive #if branch
+const char* scan_skipped_text(const char* ptr);
+
+#endif // SCAN_H
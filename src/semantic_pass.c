@@ -35,6 +35,8 @@ Copyright (c) 26 Yann BOUCHER (yann)
 #define AST_PASS_NAME semanal
 #include "ast_functions.h"
 
+#define ALLOC_TAG ALLOC_TAG_SEMANTIC
+
         static int in_function;
 static int nest_depth;
 static int loop_depth;
@@ -50,7 +52,7 @@ static local_variable_t* find_local(ident_t* ident, int* id)
     for (int i = 0; i < current_function->locals.size; ++i)
     {
         local_variable_t* item = &current_function->locals.ptr[i];
-        if (!item->temp && item->nest_depth <= nest_depth && strcmp(item->ident.name->data.str, ident->name->data.str) == 0) // FIXME : wtf it won't work idiot
+        if (!item->temp && item->nest_depth <= nest_depth && item->ident.name->data.str == ident->name->data.str) // FIXME : wtf it won't work idiot
         {
             *id = i;
             return item;
@@ -64,7 +66,7 @@ static global_variable_t* find_global(ident_t* ident, int* id)
     for (int i = 0; i < current_program->globals.size; ++i)
     {
         global_variable_t* item = &current_program->globals.ptr[i];
-        if (strcmp(item->ident.name->data.str, ident->name->data.str) == 0)
+        if (item->ident.name->data.str == ident->name->data.str)
         {
             *id = i;
             return item;
@@ -93,7 +95,7 @@ static function_t* find_function(ident_t* ident)
     {
         function_t* item = &current_program->function_list.ptr[i];
         // operator overloads shouldn't be explicitely called
-        if (!item->is_operator_overload && strcmp(item->name->data.str, ident->name->data.str) == 0)
+        if (!item->is_operator_overload && item->name->data.str == ident->name->data.str)
         {
             return item;
         }
@@ -197,7 +199,7 @@ static void semanal_ident(ident_t* ident)
     }
     else
     {
-        error(ident->name->location, ident->name->length, "unknown identifier '%s'\n", ident->name->data.str);
+        error(*token_loc(ident->name), ident->name->length, "unknown identifier '%s'\n", ident->name->data.str);
     }
 }
 static void semanal_int_constant(token_t* val)
@@ -222,7 +224,7 @@ AST_FUNCTION()
 {
     in_function = 1;
     current_function = arg_function;
-    DYNARRAY_INIT(current_function->locals, 16);
+    DYNARRAY_INIT(current_function->locals, arg_function->args.size + arg_function->local_declaration_count);
 
     // Declare the parameters as local variables
     for (int i = 0; i < arg_function->args.size; ++i)
@@ -266,7 +268,7 @@ AST_RETURN_STATEMENT()
     {
         type_t void_type = mk_type(VOID);
         if (!cmp_types(&current_function->signature.ret_type, &void_type))
-            error(arg_return_statement->return_token->location, arg_return_statement->return_token->length, "function return type is not void");
+            error(*token_loc(arg_return_statement->return_token), arg_return_statement->return_token->length, "function return type is not void");
     }
 }
 
@@ -378,7 +380,7 @@ AST_FOREACH_STATEMENT()
     assign->expr = danpa_alloc(sizeof(expression_t));
     assign->expr->flags = 0;
     assign->expr->kind = PRIM_EXPR;
-    assign->expr->loc = arg_foreach_statement->loop_ident.name->location;
+    assign->expr->loc = *token_loc(arg_foreach_statement->loop_ident.name);
     assign->expr->length = arg_foreach_statement->loop_ident.name->length;
 
     assign->expr->prim_expr.type = ARRAY_SUBSCRIPT;
@@ -462,7 +464,7 @@ AST_STATEMENT()
 AST_LOOP_CTRL_STATEMENT()
 {
     if (loop_depth == 0)
-        error(arg_loop_ctrl_statement->tok->location, arg_loop_ctrl_statement->tok->length, "loop control statement cannot be use outside of a loop\n");
+        error(*token_loc(arg_loop_ctrl_statement->tok), arg_loop_ctrl_statement->tok->length, "loop control statement cannot be use outside of a loop\n");
     AST_LOOP_CTRL_STATEMENT();
 }
 
@@ -557,12 +559,12 @@ AST_BINOP()
         while (arg_binop->right.loc.macro_invok_type == MACRO_ARG_TOKEN)
         {
             arg_binop->right.length = arg_binop->right.loc.macro_invok_token->length;
-            arg_binop->right.loc = arg_binop->right.loc.macro_invok_token->location;
+            arg_binop->right.loc = *token_loc(arg_binop->right.loc.macro_invok_token);
         }
         while (arg_binop->left.loc.macro_invok_type == MACRO_ARG_TOKEN)
         {
             arg_binop->left.length = arg_binop->left.loc.macro_invok_token->length;
-            arg_binop->left.loc = arg_binop->left.loc.macro_invok_token->location;
+            arg_binop->left.loc = *token_loc(arg_binop->left.loc.macro_invok_token);
         }
 */
         error(arg_binop->left.loc, (arg_binop->right.loc.ptr + arg_binop->right.length) - arg_binop->left.loc.ptr,
@@ -632,7 +634,7 @@ AST_FUNC_CALL_EXPRESSION()
     for (int i = 0; i < arg_function_call->signature->parameter_types.size; ++i)
     {
         generate_type_conversion(arg_function_call->arguments.ptr[i]->loc, arg_function_call->arguments.ptr[i]->length,
-                                 arg_function_call->arguments.ptr[i], &arg_function_call->signature->parameter_types.ptr[i]);
+                                 arg_function_call->arguments.ptr[i], &SMALL_DYNARRAY_DATA(arg_function_call->signature->parameter_types)[i]);
     }
 }
 
@@ -821,21 +823,23 @@ AST_MATCH_PATTERN()
 
 AST_MATCH_CASE()
 {
+    match_pattern_t* patterns = SMALL_DYNARRAY_DATA(arg_match_case->patterns);
+
     for (int i = 0; i < arg_match_case->patterns.size; ++i)
-        semanal_match_pattern(&arg_match_case->patterns.ptr[i]);
+        semanal_match_pattern(&patterns[i]);
 
     // check types
     for (int i = 1; i < arg_match_case->patterns.size; ++i)
     {
-        if (!cmp_types(&arg_match_case->patterns.ptr[0].value_type, &arg_match_case->patterns.ptr[i].value_type))
+        if (!cmp_types(&patterns[0].value_type, &patterns[i].value_type))
         {
-            error(arg_match_case->patterns.ptr[i].loc, arg_match_case->patterns.ptr[i].length, "pattern types don't match\n");
+            error(patterns[i].loc, patterns[i].length, "pattern types don't match\n");
         }
     }
 
     semanal_expression(arg_match_case->expr);
 
-    arg_match_case->value_type = arg_match_case->patterns.ptr[0].value_type;
+    arg_match_case->value_type = patterns[0].value_type;
 }
 
 AST_MATCH_EXPR()
@@ -919,12 +923,12 @@ AST_STRUCT_ACCESS()
 
     for (int i = 0; i < struct_type->fields.size; ++i)
     {
-        if (strcmp(arg_struct_access->field_name->data.str, struct_type->fields.ptr[i].name->data.str) == 0)
+        if (arg_struct_access->field_name->data.str == struct_type->fields.ptr[i].name->data.str)
             field = &struct_type->fields.ptr[i];
     }
     if (field == NULL)
     {
-        error(arg_struct_access->field_name->location, arg_struct_access->field_name->length, "type %s has no field named %s\n", type_to_str(&expr_type), arg_struct_access->field_name->data.str);
+        error(*token_loc(arg_struct_access->field_name), arg_struct_access->field_name->length, "type %s has no field named %s\n", type_to_str(&expr_type), arg_struct_access->field_name->data.str);
     }
 
     arg_struct_access->field = field;
@@ -984,8 +988,8 @@ AST_CAST_EXPRESSION()
     type_t to     = arg_cast_expression->target_type;
     if (!can_explicit_cast(&from, &to))
     {
-        error(arg_cast_expression->cast_type_token->location,
-              (arg_cast_expression->expr->loc.ptr + arg_cast_expression->expr->length) - arg_cast_expression->cast_type_token->location.ptr,
+        error(*token_loc(arg_cast_expression->cast_type_token),
+              (arg_cast_expression->expr->loc.ptr + arg_cast_expression->expr->length) - token_loc(arg_cast_expression->cast_type_token)->ptr,
               "cannot cast '%s' to '%s'\n", type_to_str(&from), type_to_str(&to));
     }
 }
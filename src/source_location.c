@@ -0,0 +1,124 @@
+#include "source_location.h"
+
+#include <string.h>
+
+#include "alloc.h"
+#include "scan.h"
+
+#define ALLOC_TAG ALLOC_TAG_LEXER
+
+source_location_t** location_chunks;
+uint32_t location_count;
+static uint32_t chunk_count;
+static uint32_t chunk_capacity;
+
+static void add_location_chunk()
+{
+    if (chunk_count == chunk_capacity)
+    {
+        // the chunk index is tiny next to the chunks themselves
+        chunk_capacity = chunk_capacity ? chunk_capacity*2 : 64;
+        source_location_t** chunks = danpa_alloc_in(REGION_GLOBAL, chunk_capacity*sizeof(source_location_t*));
+        if (chunk_count)
+            memcpy(chunks, location_chunks, chunk_count*sizeof(source_location_t*));
+        location_chunks = chunks;
+    }
+
+    location_chunks[chunk_count++] = danpa_alloc_in(REGION_GLOBAL, LOCATION_CHUNK_SIZE*sizeof(source_location_t));
+}
+
+loc_id_t add_location(const source_location_t* loc)
+{
+    // chunks dropped by truncate_locations() are kept and reused
+    if ((location_count >> LOCATION_CHUNK_BITS) == chunk_count)
+        add_location_chunk();
+
+    location_chunks[location_count >> LOCATION_CHUNK_BITS][location_count & (LOCATION_CHUNK_SIZE-1)] = *loc;
+    return location_count++;
+}
+
+void truncate_locations(uint32_t count)
+{
+    location_count = count;
+}
+
+static source_file_t* source_files;
+static int source_file_count;
+static int source_file_capacity;
+
+int add_source_file(const char* filename, const char* base, size_t size)
+{
+    if (source_file_count == source_file_capacity)
+    {
+        source_file_capacity = source_file_capacity ? source_file_capacity*2 : 16;
+        source_file_t* files = danpa_alloc_in(REGION_GLOBAL, source_file_capacity*sizeof(source_file_t));
+        if (source_file_count)
+            memcpy(files, source_files, source_file_count*sizeof(source_file_t));
+        source_files = files;
+    }
+
+    source_file_t* file = &source_files[source_file_count];
+    file->filename = filename;
+    file->base = base;
+    file->size = size;
+    file->line_starts = NULL;
+    file->line_count = 0;
+
+    return source_file_count++;
+}
+
+const source_file_t* get_source_file(int file_id)
+{
+    return &source_files[file_id];
+}
+
+// newlines are paired the same way as the lexer does, see skip_newline()
+static void build_line_index(source_file_t* file)
+{
+    uint32_t count = 1;
+    for (const char* ptr = scan_line_end(file->base); *ptr; ptr = scan_line_end(ptr))
+    {
+        skip_newline(&ptr);
+        ++count;
+    }
+
+    file->line_starts = danpa_alloc_in(REGION_GLOBAL, count*sizeof(uint32_t));
+    file->line_starts[0] = 0;
+    file->line_count = 1;
+    for (const char* ptr = scan_line_end(file->base); *ptr; ptr = scan_line_end(ptr))
+    {
+        skip_newline(&ptr);
+        file->line_starts[file->line_count++] = ptr - file->base;
+    }
+}
+
+int location_line(const source_location_t* loc, const char** line_ptr)
+{
+    source_file_t* file = &source_files[loc->file_id];
+    // the buffer is followed by an added newline and the null terminator
+    if (loc->ptr < file->base || loc->ptr > file->base + file->size + 1)
+    {
+        if (line_ptr)
+            *line_ptr = loc->ptr;
+        return 0;
+    }
+
+    if (!file->line_starts)
+        build_line_index(file);
+
+    // last line starting at or before the location
+    const uint32_t offset = loc->ptr - file->base;
+    uint32_t low = 0, high = file->line_count;
+    while (high - low > 1)
+    {
+        const uint32_t mid = (low + high) / 2;
+        if (file->line_starts[mid] <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    if (line_ptr)
+        *line_ptr = file->base + file->line_starts[low];
+    return low + 1;
+}
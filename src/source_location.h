@@ -1,12 +1,14 @@
 #ifndef SOURCE_LOCATION_H
 #define SOURCE_LOCATION_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 typedef struct token_t token_t;
 
+// locations don't track lines : they are resolved from the file's line index when a diagnostic needs them
 typedef struct source_location_t
 {
-    const char* filename;
-    const char* line_ptr;
     const char* ptr;
     struct token_t* macro_invok_token;
     enum
@@ -15,13 +17,43 @@ typedef struct source_location_t
         MACRO_TOKEN,
         MACRO_ARG_TOKEN,
     } macro_invok_type;
-    int line;
+    int file_id;
 } source_location_t;
 
-static inline void update_loc_newline(source_location_t* loc, const char* line_start)
+typedef struct source_file_t
+{
+    const char* filename;
+    const char* base;
+    size_t size;
+    uint32_t* line_starts; // offsets of the line starts, built on the first lookup
+    uint32_t line_count;
+} source_file_t;
+
+// registers a null-terminated source buffer, returns its file id
+int add_source_file(const char* filename, const char* base, size_t size);
+const source_file_t* get_source_file(int file_id);
+// returns the 1-based line of the location, *line_ptr (if not NULL) receives the start of that line.
+// locations outside of their file (token concatenation buffers) are reported on line 0, starting at ptr
+int location_line(const source_location_t* loc, const char** line_ptr);
+
+// tokens don't embed their location : they refer to an entry of the location table, which is only read by diagnostics
+// and by the few places that need the token's spelling
+typedef uint32_t loc_id_t;
+
+#define LOCATION_CHUNK_BITS 12
+#define LOCATION_CHUNK_SIZE (1u << LOCATION_CHUNK_BITS)
+
+// the table grows a chunk at a time, so entries never move
+extern source_location_t** location_chunks;
+extern uint32_t location_count;
+
+loc_id_t add_location(const source_location_t* loc);
+// drops the entries added after 'count' was read from location_count
+void truncate_locations(uint32_t count);
+
+static inline source_location_t* get_location(loc_id_t id)
 {
-    ++loc->line;
-    loc->ptr = loc->line_ptr = line_start;
+    return &location_chunks[id >> LOCATION_CHUNK_BITS][id & (LOCATION_CHUNK_SIZE-1)];
 }
 
 #endif // SOURCE_LOCATION_H
@@ -0,0 +1,198 @@
+/*
+token_stream.c
+
+Copyright (c) 26 Yann BOUCHER (yann)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "token_stream.h"
+#include "preprocessor.h"
+#include "alloc.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define ALLOC_TAG ALLOC_TAG_LEXER
+
+typedef DYNARRAY(token_t*) token_block_list_t;
+
+static struct
+{
+    source_location_t loc; // raw lexer position
+    int first_step;
+    int lexer_done;
+
+    // raw tokens, not macro-expanded yet
+    token_list_t raw;
+    int raw_pos;  // first raw token that wasn't expanded
+    int cut_scan; // first raw token not checked by find_cut()
+    int parenthesis_depth;
+
+    // tokens are expanded a segment at a time
+    token_list_t segment;
+    token_list_t scratch;
+
+    token_block_list_t blocks; // blocks[i] holds the tokens of the absolute block first_block + i
+    token_block_list_t free_blocks;
+    int first_block;
+    int token_count;
+    int has_eof;
+} stream;
+
+void init_token_stream(int file_id)
+{
+    memset(&stream, 0, sizeof(stream));
+    stream.loc.file_id = file_id;
+    stream.loc.ptr = get_source_file(file_id)->base;
+    stream.first_step = 1;
+
+    prefetch_includes(get_source_file(file_id)->base, get_source_file(file_id)->size);
+
+    DYNARRAY_INIT(stream.raw, 256);
+    DYNARRAY_INIT(stream.segment, 256);
+    DYNARRAY_INIT(stream.scratch, 256);
+    DYNARRAY_INIT(stream.blocks, 16);
+    DYNARRAY_INIT(stream.free_blocks, 16);
+}
+
+static void append_token(const token_t* tok)
+{
+    const int block = (stream.token_count >> TOKEN_BLOCK_BITS) - stream.first_block;
+    if (block == stream.blocks.size)
+    {
+        token_t* new_block;
+        if (stream.free_blocks.size)
+        {
+            new_block = DYNARRAY_BACK(stream.free_blocks);
+            DYNARRAY_POP(stream.free_blocks);
+        }
+        else
+            new_block = danpa_alloc(TOKEN_BLOCK_SIZE*sizeof(token_t));
+        DYNARRAY_ADD(stream.blocks, new_block);
+    }
+
+    stream.blocks.ptr[block][stream.token_count & (TOKEN_BLOCK_SIZE-1)] = *tok;
+    ++stream.token_count;
+}
+
+// Expanding a part of the program on its own gives the same result as expanding the whole program as long as no macro
+// invocation straddles the cut : the segments end on a ';' or a '}' outside of any parenthesis, that isn't followed by
+// a '(' (any macro name followed by a parenthesis takes arguments).
+// The last raw token isn't looked at, a '##' could still modify it.
+static int find_cut()
+{
+    for (; stream.cut_scan < stream.raw.size-1; ++stream.cut_scan)
+    {
+        const token_t* tok = &stream.raw.ptr[stream.cut_scan];
+        if (tok->type == TOK_OPEN_PARENTHESIS)
+            ++stream.parenthesis_depth;
+        else if (tok->type == TOK_CLOSE_PARENTHESIS && stream.parenthesis_depth > 0)
+            --stream.parenthesis_depth;
+        else if ((tok->type == TOK_SEMICOLON || tok->type == TOK_CLOSE_BRACE) && stream.parenthesis_depth == 0 &&
+                 stream.raw.ptr[stream.cut_scan+1].type != TOK_OPEN_PARENTHESIS)
+            return stream.cut_scan++;
+    }
+
+    return -1;
+}
+
+static void lex_step()
+{
+    const int flags = LEX_SINGLE_TOKEN | (stream.first_step ? STARTS_ON_NEWLINE : 0);
+    stream.first_step = 0;
+
+    if (do_tokenization(&stream.raw, &stream.loc, flags) == NULL || *stream.loc.ptr == '\0')
+        stream.lexer_done = 1;
+}
+
+static void add_eof_token()
+{
+    token_t eof;
+    memset(&eof, 0, sizeof(eof));
+    eof.type = TOKEN_EOF;
+    eof.length = 1;
+    if (stream.token_count)
+        eof.loc_id = stream_token(stream.token_count-1)->loc_id;
+    else
+        eof.loc_id = add_location(&(source_location_t){.ptr = stream.loc.ptr, .file_id = stream.loc.file_id});
+
+    append_token(&eof);
+    stream.has_eof = 1;
+}
+
+// lexes and expands the next segment
+static void produce_segment()
+{
+    // drop the raw tokens that were already expanded
+    if (stream.raw_pos > 4096 && stream.raw_pos > stream.raw.size/2)
+    {
+        memmove(stream.raw.ptr, stream.raw.ptr + stream.raw_pos, (stream.raw.size - stream.raw_pos)*sizeof(token_t));
+        stream.raw.size -= stream.raw_pos;
+        stream.cut_scan -= stream.raw_pos;
+        stream.raw_pos = 0;
+    }
+
+    int cut;
+    while ((cut = find_cut()) < 0 && !stream.lexer_done)
+        lex_step();
+
+    const int end = cut < 0 ? stream.raw.size : cut + 1;
+    DYNARRAY_RESIZE(stream.segment, end - stream.raw_pos);
+    memcpy(stream.segment.ptr, stream.raw.ptr + stream.raw_pos, stream.segment.size*sizeof(token_t));
+    stream.raw_pos = end;
+
+    expand_macros(&stream.segment, &stream.scratch, 0);
+    for (int i = 0; i < stream.segment.size; ++i)
+        append_token(&stream.segment.ptr[i]);
+
+    if (stream.lexer_done && stream.raw_pos == stream.raw.size)
+        add_eof_token();
+}
+
+token_t* stream_token(int index)
+{
+    if (index >= stream.token_count && !stream.has_eof)
+    {
+        const alloc_region_t previous_region = set_alloc_region(REGION_LEXER);
+        while (index >= stream.token_count && !stream.has_eof)
+            produce_segment();
+        set_alloc_region(previous_region);
+    }
+
+    if (index >= stream.token_count)
+        index = stream.token_count-1; // EOF
+
+    assert((index >> TOKEN_BLOCK_BITS) >= stream.first_block);
+    return &stream.blocks.ptr[(index >> TOKEN_BLOCK_BITS) - stream.first_block][index & (TOKEN_BLOCK_SIZE-1)];
+}
+
+void release_tokens_before(int index)
+{
+    int released = (index >> TOKEN_BLOCK_BITS) - stream.first_block;
+    if (released <= 0)
+        return;
+
+    for (int i = 0; i < released; ++i)
+        DYNARRAY_ADD(stream.free_blocks, stream.blocks.ptr[i]);
+    memmove(stream.blocks.ptr, stream.blocks.ptr + released, (stream.blocks.size - released)*sizeof(token_t*));
+    stream.blocks.size -= released;
+    stream.first_block += released;
+}
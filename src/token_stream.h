@@ -0,0 +1,19 @@
+#ifndef TOKEN_STREAM_H
+#define TOKEN_STREAM_H
+
+#include "lexer.h"
+
+// The program is lexed and macro-expanded on demand, as the parser reads it.
+// Tokens are stored in fixed-size blocks : the pointers handed to the parser stay valid until their block is released.
+
+#define TOKEN_BLOCK_BITS 10
+#define TOKEN_BLOCK_SIZE (1 << TOKEN_BLOCK_BITS)
+
+void init_token_stream(int file_id);
+// returns the token at the absolute position 'index', lexing up to it if needed.
+// the stream ends with a TOKEN_EOF token, which is returned for any position past the end
+token_t* stream_token(int index);
+// recycles the blocks holding only tokens before 'index'
+void release_tokens_before(int index);
+
+#endif // TOKEN_STREAM_H
@@ -26,12 +26,15 @@ Copyright (c) 25 Yann BOUCHER (yann)
 #include "types.h"
 #include "error.h"
 #include "ast_nodes.h"
+#include "hash_table.h"
 
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
+#define ALLOC_TAG ALLOC_TAG_CURRENT
+
         typedef DYNARRAY(const char*) types_str_t;
 
 const char* default_types_str[DEFAULT_TYPES_END] =
@@ -47,16 +50,21 @@ const char* default_types_str[DEFAULT_TYPES_END] =
         "<any>"
 };
 
-static types_str_t types_str;
+static types_str_t types_str; // the names of the base types, by id
+
+static DYNARRAY(structure_t) defined_structures;
 
-typedef struct typedef_alias_t
+// the type names in scope : the builtin types, the structures and the typedefs
+typedef struct type_name_t
 {
-    const char* alias;
+    const char* name;
     type_t type;
-} typedef_alias_t;
+    int shadowed; // the binding of the same name in an enclosing scope, -1 if there is none
+} type_name_t;
 
-static DYNARRAY(structure_t) defined_structures;
-static DYNARRAY(typedef_alias_t) typedef_list;
+static hash_table_t type_table; // interned name -> index of its innermost binding, -1 once it went out of scope
+static DYNARRAY(type_name_t) type_names; // the bindings of the open scopes, the innermost last
+static DYNARRAY(int) scope_starts; // the first binding of each open scope
 
 // 0 - cannot, 1 - explicit, 2 - always
 const uint8_t cast_matrix[POD_TYPES_END][POD_TYPES_END] =
@@ -79,12 +87,54 @@ type_t mk_type(base_type_t base)
     return type;
 }
 
+static void bind_type_name(const char* name, type_t type)
+{
+    hash_value_t* val = hash_table_get_interned(&type_table, name);
+    DYNARRAY_ADD(type_names, (type_name_t){name, type, val ? val->idx : -1});
+    if (val)
+        val->idx = type_names.size-1;
+    else
+        hash_table_insert_interned(&type_table, name, (hash_value_t){.idx = type_names.size-1});
+}
+
 void types_init()
 {
     DYNARRAY_INIT(defined_structures, 32);
     DYNARRAY_INIT(types_str, DEFAULT_TYPES_END + 32);
     DYNARRAY_RESIZE(types_str, DEFAULT_TYPES_END);
-    memcpy(types_str.ptr, default_types_str, DEFAULT_TYPES_END*sizeof(const char*));
+
+    type_table = mk_hash_table(512);
+    DYNARRAY_INIT(type_names, DEFAULT_TYPES_END + 64);
+    DYNARRAY_INIT(scope_starts, 16);
+    for (int i = 0; i < DEFAULT_TYPES_END; ++i)
+    {
+        types_str.ptr[i] = intern_string(default_types_str[i], strlen(default_types_str[i]));
+        bind_type_name(types_str.ptr[i], mk_type((base_type_t)i));
+    }
+}
+
+void types_enter_scope()
+{
+    DYNARRAY_ADD(scope_starts, type_names.size);
+}
+
+void types_exit_scope()
+{
+    assert(scope_starts.size > 0);
+    const int start = DYNARRAY_BACK(scope_starts);
+    DYNARRAY_POP(scope_starts);
+
+    // the shadowed bindings are visible again
+    for (int i = type_names.size-1; i >= start; --i)
+        hash_table_get_interned(&type_table, type_names.ptr[i].name)->idx = type_names.ptr[i].shadowed;
+    DYNARRAY_RESIZE(type_names, start);
+}
+
+int type_in_current_scope(const char* type_str)
+{
+    const hash_value_t* val = hash_table_get_interned(&type_table, type_str);
+    const int scope_start = scope_starts.size ? DYNARRAY_BACK(scope_starts) : 0;
+    return val && val->idx >= scope_start;
 }
 
 const char* type_to_str(const type_t* type)
@@ -123,7 +173,7 @@ const char* type_to_str(const type_t* type)
         length += snprintf(type_str_buffer+length, 256-length, "%s(", ret_type_str);
         for (int i = 0; i < type->function.signature->parameter_types.size; ++i)
         {
-            const char* param_type = type_to_str(&type->function.signature->parameter_types.ptr[i]);
+            const char* param_type = type_to_str(&SMALL_DYNARRAY_DATA(type->function.signature->parameter_types)[i]);
             length += snprintf(type_str_buffer+length, 256-length, "%s", param_type);
 
             if (i != type->function.signature->parameter_types.size-1)
@@ -213,7 +263,7 @@ int cmp_types(const type_t* lhs, const type_t* rhs)
             return 0;
         for (int i = 0; i < lhs->function.signature->parameter_types.size; ++i)
         {
-            if (!cmp_types(&lhs->function.signature->parameter_types.ptr[i], &rhs->function.signature->parameter_types.ptr[i]))
+            if (!cmp_types(&SMALL_DYNARRAY_DATA(lhs->function.signature->parameter_types)[i], &SMALL_DYNARRAY_DATA(rhs->function.signature->parameter_types)[i]))
                 return 0;
         }
         return 1;
@@ -387,28 +437,16 @@ type_t get_expression_type(const expression_t *expr)
 
 type_t get_type(const char* type)
 {
-    for (int i = 0; i < types_str.size; ++i)
-    {
-        if (strcmp(type, types_str.ptr[i]) == 0)
-        {
-            return mk_type((base_type_t)i);
-        }
-    }
+    const hash_value_t* val = hash_table_get_interned(&type_table, type);
+    if (!val || val->idx < 0)
+        return mk_type(INVALID_TYPE);
 
-    for (int i = 0; i < typedef_list.size; ++i)
-    {
-        if (strcmp(type, typedef_list.ptr[i].alias) == 0)
-        {
-            return typedef_list.ptr[i].type;
-        }
-    }
-
-    return mk_type(INVALID_TYPE);
+    return type_names.ptr[val->idx].type;
 }
 
 void add_typedef(const char* alias, type_t real_type)
 {
-    DYNARRAY_ADD(typedef_list, {alias, real_type});
+    bind_type_name(alias, real_type);
 }
 
 int can_implicit_cast(const type_t* from, const type_t* to)
@@ -441,16 +479,21 @@ int can_explicit_cast(const type_t* from, const type_t* to)
 
 type_t forward_declare_structure(const char* name)
 {
+    // declared again before its definition
+    type_t existing = get_type(name);
+    if (is_struct(&existing) && get_struct(&existing)->incomplete)
+        return existing;
+
     structure_t dummy;
-    dummy.incomplete = 1;
+    memset(&dummy, 0, sizeof(dummy));
+    dummy.incomplete = 1; // until define_structure()
 
     DYNARRAY_ADD(types_str, name);
     DYNARRAY_ADD(defined_structures, dummy);
-    defined_structures.ptr[defined_structures.size-1].incomplete = 0;
 
-    type_t new_type;
-    new_type.base_type = DEFAULT_TYPES_END + defined_structures.size-1;
-    return new_type; // structure id + default type offset
+    type_t new_type = mk_type(DEFAULT_TYPES_END + defined_structures.size-1); // structure id + default type offset
+    bind_type_name(name, new_type);
+    return new_type;
 }
 
 void define_structure(type_t *type, const structure_t *structure)
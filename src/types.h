@@ -97,7 +97,7 @@ typedef struct type_t
 typedef struct function_signature_t
 {
     type_t ret_type;
-    DYNARRAY(type_t) parameter_types;
+    SMALL_DYNARRAY(type_t, 4) parameter_types;
 } function_signature_t;
 
 typedef struct structure_field_t
@@ -117,10 +117,17 @@ typedef struct structure_t
 } structure_t;
 
 void types_init();
+// typedefs are lexically scoped : the ones declared after types_enter_scope() are forgotten by the matching types_exit_scope(),
+// and can shadow the type names of the enclosing scopes
+void types_enter_scope();
+void types_exit_scope();
+// returns 1 if the name was declared as a type in the innermost scope. type_str must be interned
+int type_in_current_scope(const char* type_str);
 
 type_t mk_type(base_type_t base);
 
 const char* type_to_str(const type_t* type);
+// type_str must be interned
 type_t get_type(const char* type_str);
 int is_lvalue(const primary_expression_t* prim_expr);
 static inline int is_struct(const type_t* type)
@@ -141,7 +148,7 @@ int cmp_types(const type_t* lhs, const type_t* rhs);
 size_t sizeof_type(const type_t* type);
 void add_typedef(const char* alias, type_t real_type);
 
-// returns type id
+// returns type id. the structure stays incomplete until define_structure(), declaring it again returns the same type
 type_t forward_declare_structure(const char* name);
 void define_structure(type_t* type, const structure_t* structure);
 